@@ -0,0 +1,192 @@
+#include "Equaliser.h"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+
+Equaliser::Equaliser(cl::Context context, cl::Device device, const std::string& kernelFile)
+	: context(context), device(device), commandQueue(context, device, CL_QUEUE_PROFILING_ENABLE) {
+
+	// reads the kernel source
+	std::ifstream file(kernelFile);
+	if (!file.good()) {
+		throw cl::Error(CL_INVALID_VALUE, "Equaliser: kernel file not found");
+	}
+	std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	cl::Program::Sources sources;
+	sources.push_back(source);
+	program = cl::Program(context, sources);
+
+	//build and debug the kernel code
+	try {
+		program.build({ device });
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		throw err;
+	}
+	setup();
+}
+
+Equaliser::Equaliser(cl::Context context, cl::Device device, cl::CommandQueue queue, cl::Program program)
+	: context(context), device(device), commandQueue(queue), program(program) {
+	setup();
+}
+
+void Equaliser::setup() {
+	histogramKernel = cl::Kernel(program, "histogram_coarse");
+	scanKernel = cl::Kernel(program, "scan_segmented");
+	boundsKernel = cl::Kernel(program, "cdf_bounds");
+	normaliseKernel = cl::Kernel(program, "normalise");
+	equaliseKernel = cl::Kernel(program, "equalise_coarse");
+	histogramGroupSize = histogramKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	scanGroupSize = scanKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	equaliseGroupSize = equaliseKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+	binDiv = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	countBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	binsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	bitsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	totals = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+	firsts = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+	minNumBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+	maxNumBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+}
+
+// the write blocks, and the queue is in order, so an earlier launch has read the old value before it changes
+void Equaliser::setConstant(cl::Buffer& buffer, unsigned int value) {
+	commandQueue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sizeof(unsigned int), &value);
+}
+
+cl::Buffer& Equaliser::scratch(cl::Buffer& buffer, size_t bytes) {
+	if (buffer() == NULL || buffer.getInfo<CL_MEM_SIZE>() < bytes) {
+		buffer = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+	}
+	return buffer;
+}
+
+// work group size for the strided kernels, the global size is capped as every work item loops over its pixels
+static cl::NDRange stridedGlobal(size_t count, size_t local) {
+	size_t groups = std::min((count + local - 1) / local, (size_t)1024);
+	return cl::NDRange(groups * local);
+}
+
+void Equaliser::histogram(cl::Buffer& pixels, size_t count, unsigned int bits, cl::Buffer& histogram, unsigned int bins, cl::Event* event) {
+	if (bins == 0 || bits % bins != 0) {
+		throw cl::Error(CL_INVALID_VALUE, "Equaliser: bins must divide the bit depth");
+	}
+	commandQueue.enqueueFillBuffer(histogram, 0u, 0, bins * sizeof(unsigned int));
+	setConstant(binDiv, bits / bins);
+	setConstant(countBuffer, (unsigned int)count);
+
+	histogramKernel.setArg(0, pixels);
+	histogramKernel.setArg(1, histogram);
+	histogramKernel.setArg(2, binDiv);
+	histogramKernel.setArg(3, countBuffer);
+
+	size_t LocalSize = std::min((size_t)256, histogramGroupSize);
+	commandQueue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, stridedGlobal(count, LocalSize), cl::NDRange(LocalSize), NULL, event);
+}
+
+void Equaliser::cumulative(cl::Buffer& histogram, cl::Buffer& cumulative, unsigned int bins, cl::Event* event) {
+
+	// single work group scan, each work item scans a run of bins
+	size_t LocalSize = std::min((size_t)bins, scanGroupSize);
+	while (bins % LocalSize != 0) {
+		LocalSize--;
+	}
+	setConstant(binsBuffer, bins);
+
+	scanKernel.setArg(0, histogram);
+	scanKernel.setArg(1, cumulative);
+	scanKernel.setArg(2, cl::Buffer());
+	scanKernel.setArg(3, totals);
+	scanKernel.setArg(4, firsts);
+	scanKernel.setArg(5, binsBuffer);
+	scanKernel.setArg(6, cl::Local(LocalSize * sizeof(unsigned int)));
+	commandQueue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(LocalSize), cl::NDRange(LocalSize), NULL, event);
+}
+
+void Equaliser::lut(cl::Buffer& cumulative, unsigned int bins, unsigned int bits, cl::Event* event) {
+
+	// finds min and max of the cumulative histogram, min stays 0 for an empty histogram
+	commandQueue.enqueueFillBuffer(minNumBuffer, 0u, 0, sizeof(unsigned int));
+	boundsKernel.setArg(0, cumulative);
+	boundsKernel.setArg(1, minNumBuffer);
+	boundsKernel.setArg(2, maxNumBuffer);
+	commandQueue.enqueueNDRangeKernel(boundsKernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+
+	// normalises the cumulative histogram in place
+	setConstant(bitsBuffer, bits);
+	normaliseKernel.setArg(0, cumulative);
+	normaliseKernel.setArg(1, minNumBuffer);
+	normaliseKernel.setArg(2, maxNumBuffer);
+	normaliseKernel.setArg(3, bitsBuffer);
+	commandQueue.enqueueNDRangeKernel(normaliseKernel, cl::NullRange, cl::NDRange(bins), cl::NullRange, NULL, event);
+}
+
+void Equaliser::equalise(cl::Buffer& pixels, size_t count, unsigned int bits, cl::Buffer& lut, unsigned int bins, cl::Buffer& output, cl::Event* event) {
+	if (bins == 0 || bits % bins != 0) {
+		throw cl::Error(CL_INVALID_VALUE, "Equaliser: bins must divide the bit depth");
+	}
+	setConstant(binDiv, bits / bins);
+	setConstant(countBuffer, (unsigned int)count);
+
+	equaliseKernel.setArg(0, pixels);
+	equaliseKernel.setArg(1, output);
+	equaliseKernel.setArg(2, lut);
+	equaliseKernel.setArg(3, binDiv);
+	equaliseKernel.setArg(4, countBuffer);
+
+	size_t LocalSize = std::min((size_t)256, equaliseGroupSize);
+	commandQueue.enqueueNDRangeKernel(equaliseKernel, cl::NullRange, stridedGlobal(count, LocalSize), cl::NDRange(LocalSize), NULL, event);
+}
+
+void Equaliser::histogram(const unsigned int* pixels, size_t count, unsigned int bits, unsigned int* histogram, unsigned int bins) {
+	cl::Buffer& dev_image_input = scratch(inputScratch, count * sizeof(unsigned int));
+	cl::Buffer& histogramBuf = scratch(lutScratch, bins * sizeof(unsigned int));
+	commandQueue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, count * sizeof(unsigned int), pixels);
+	this->histogram(dev_image_input, count, bits, histogramBuf, bins);
+	commandQueue.enqueueReadBuffer(histogramBuf, CL_TRUE, 0, bins * sizeof(unsigned int), histogram);
+}
+
+void Equaliser::cumulative(const unsigned int* histogram, unsigned int* cumulative, unsigned int bins) {
+	cl::Buffer& histogramBuf = scratch(lutScratch, bins * sizeof(unsigned int));
+	commandQueue.enqueueWriteBuffer(histogramBuf, CL_FALSE, 0, bins * sizeof(unsigned int), histogram);
+	this->cumulative(histogramBuf, histogramBuf, bins);
+	commandQueue.enqueueReadBuffer(histogramBuf, CL_TRUE, 0, bins * sizeof(unsigned int), cumulative);
+}
+
+void Equaliser::lut(const unsigned int* cumulative, unsigned int* lut, unsigned int bins, unsigned int bits) {
+	cl::Buffer& lutBuf = scratch(lutScratch, bins * sizeof(unsigned int));
+	commandQueue.enqueueWriteBuffer(lutBuf, CL_FALSE, 0, bins * sizeof(unsigned int), cumulative);
+	this->lut(lutBuf, bins, bits);
+	commandQueue.enqueueReadBuffer(lutBuf, CL_TRUE, 0, bins * sizeof(unsigned int), lut);
+}
+
+void Equaliser::equalise(const unsigned int* pixels, size_t count, unsigned int bits, const unsigned int* lut, unsigned int bins, unsigned int* output) {
+	cl::Buffer& dev_image_input = scratch(inputScratch, count * sizeof(unsigned int));
+	cl::Buffer& dev_image_output = scratch(outputScratch, count * sizeof(unsigned int));
+	cl::Buffer& lutBuf = scratch(lutScratch, bins * sizeof(unsigned int));
+	commandQueue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, count * sizeof(unsigned int), pixels);
+	commandQueue.enqueueWriteBuffer(lutBuf, CL_FALSE, 0, bins * sizeof(unsigned int), lut);
+	equalise(dev_image_input, count, bits, lutBuf, bins, dev_image_output);
+	commandQueue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, count * sizeof(unsigned int), output);
+}
+
+void Equaliser::equalise(const unsigned int* pixels, size_t count, unsigned int bits, unsigned int bins, unsigned int* output) {
+	cl::Buffer& dev_image_input = scratch(inputScratch, count * sizeof(unsigned int));
+	cl::Buffer& dev_image_output = scratch(outputScratch, count * sizeof(unsigned int));
+	cl::Buffer& lutBuf = scratch(lutScratch, bins * sizeof(unsigned int));
+	commandQueue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, count * sizeof(unsigned int), pixels);
+
+	// the histogram is scanned and normalised in place into the look up table
+	histogram(dev_image_input, count, bits, lutBuf, bins);
+	cumulative(lutBuf, lutBuf, bins);
+	lut(lutBuf, bins, bits);
+	equalise(dev_image_input, count, bits, lutBuf, bins, dev_image_output);
+
+	commandQueue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, count * sizeof(unsigned int), output);
+}
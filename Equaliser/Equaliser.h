@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_ENABLE_EXCEPTIONS
+
+#include <CL/cl2.hpp>
+
+// histogram equalisation as a library, every stage works on memory owned by the caller
+// bits is the number of intensity levels (256 or 65536) and bins must divide it, the same as the executable
+// errors are reported by throwing cl::Error
+class Equaliser {
+public:
+	// builds the kernels for the device, the kernel file is relative to the working directory
+	Equaliser(cl::Context context, cl::Device device, const std::string& kernelFile = "kernels/my_kernels.cl");
+
+	// shares a queue and a program the caller has already built from the same kernel file, so embedding costs no second build
+	Equaliser(cl::Context context, cl::Device device, cl::CommandQueue queue, cl::Program program);
+
+	// counts the pixels falling in each bin
+	void histogram(const unsigned int* pixels, size_t count, unsigned int bits, unsigned int* histogram, unsigned int bins);
+
+	// inclusive scan of a histogram
+	void cumulative(const unsigned int* histogram, unsigned int* cumulative, unsigned int bins);
+
+	// scales a cumulative histogram to the range of the bit depth
+	void lut(const unsigned int* cumulative, unsigned int* lut, unsigned int bins, unsigned int bits);
+
+	// maps every pixel through a look up table
+	void equalise(const unsigned int* pixels, size_t count, unsigned int bits, const unsigned int* lut, unsigned int bins, unsigned int* output);
+
+	// runs every stage without the intermediate results leaving the device
+	void equalise(const unsigned int* pixels, size_t count, unsigned int bits, unsigned int bins, unsigned int* output);
+
+	// the same stages enqueued on device buffers owned by the caller, so a pipeline can keep its data on the device between them
+	// nothing is waited on, event receives the stage's last kernel for profiling
+	void histogram(cl::Buffer& pixels, size_t count, unsigned int bits, cl::Buffer& histogram, unsigned int bins, cl::Event* event = NULL);
+	void cumulative(cl::Buffer& histogram, cl::Buffer& cumulative, unsigned int bins, cl::Event* event = NULL);
+	void lut(cl::Buffer& cumulative, unsigned int bins, unsigned int bits, cl::Event* event = NULL);
+	void equalise(cl::Buffer& pixels, size_t count, unsigned int bits, cl::Buffer& lut, unsigned int bins, cl::Buffer& output, cl::Event* event = NULL);
+
+	cl::CommandQueue& queue() { return commandQueue; }
+
+private:
+	cl::Context context;
+	cl::Device device;
+	cl::CommandQueue commandQueue;
+	cl::Program program;
+
+	// kernels are created once with the program, the work group sizes are the device's limits for them
+	cl::Kernel histogramKernel;
+	cl::Kernel scanKernel;
+	cl::Kernel boundsKernel;
+	cl::Kernel normaliseKernel;
+	cl::Kernel equaliseKernel;
+	size_t histogramGroupSize;
+	size_t scanGroupSize;
+	size_t equaliseGroupSize;
+
+	// single value arguments, created once and rewritten before each launch that needs them
+	cl::Buffer binDiv;
+	cl::Buffer countBuffer;
+	cl::Buffer binsBuffer;
+	cl::Buffer bitsBuffer;
+	cl::Buffer totals;
+	cl::Buffer firsts;
+	cl::Buffer minNumBuffer;
+	cl::Buffer maxNumBuffer;
+
+	// device copies for the calls that take host memory, only reallocated when a call needs more than they hold
+	cl::Buffer inputScratch;
+	cl::Buffer outputScratch;
+	cl::Buffer lutScratch;
+
+	void setup();
+	void setConstant(cl::Buffer& buffer, unsigned int value);
+	cl::Buffer& scratch(cl::Buffer& buffer, size_t bytes);
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+
+#include "Utils.h"
+
+// histogram equalisation planned once for a fixed image shape and then executed many times
+// every kernel is created with its arguments bound and every buffer is allocated up front, so execute is only enqueues
+//
+// images are planar like CImg, only the first channel is equalised and any others are copied through,
+// so colour images should be converted to YCbCr before they are passed in
+class EqualisationPlan {
+public:
+	EqualisationPlan(cl::Context context, cl::Device device, cl::CommandQueue queue, cl::Program program, unsigned int width, unsigned int height, unsigned int channels, unsigned int bitDepth, unsigned int bins, TuningDatabase* tuning = NULL)
+		: context(context), queue(queue), channels(channels), bins(bins) {
+
+		// stores the bitdepth of the image
+		bits = (bitDepth == 16) ? 65536 : 256;
+		if (bins == 0 || bits % bins != 0) {
+			throw cl::Error(CL_INVALID_VALUE, "EqualisationPlan: bins must divide the bit depth");
+		}
+		bytesPerPixel = (bitDepth == 16) ? 2 : 1;
+		pixels = (size_t)width * height;
+		unsigned int binsDivider = bits / bins;
+		unsigned int count = (unsigned int)pixels;
+
+		// buffers for the packed input and output and the 32 bit working copy of the image
+		dev_image_raw = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * bytesPerPixel);
+		dev_image_input = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(unsigned int));
+		dev_image_output = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(unsigned int));
+
+		// histogram and look up table share a buffer as the scan and normalise run in place
+		histogramBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+		cl::Buffer totals(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+		cl::Buffer firsts(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+
+		// constants written once
+		cl::Buffer binDiv(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer bitsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer binsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer countBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+		queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bins);
+		queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(unsigned int), &count);
+
+		// binds every kernel
+		unpack = cl::Kernel(program, bytesPerPixel == 2 ? "unpack16" : "unpack8");
+		unpack.setArg(0, dev_image_raw);
+		unpack.setArg(1, dev_image_input);
+
+		histogram = cl::Kernel(program, "histogram_coarse");
+		histogram.setArg(0, dev_image_input);
+		histogram.setArg(1, histogramBuffer);
+		histogram.setArg(2, binDiv);
+		histogram.setArg(3, countBuffer);
+
+		scan = cl::Kernel(program, "scan_segmented");
+		scanLocal = gcd(bins, scan.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		scan.setArg(0, histogramBuffer);
+		scan.setArg(1, histogramBuffer);
+		scan.setArg(2, cl::Buffer());
+		scan.setArg(3, totals);
+		scan.setArg(4, firsts);
+		scan.setArg(5, binsBuffer);
+		scan.setArg(6, cl::Local(scanLocal * sizeof(unsigned int)));
+
+		normalise = cl::Kernel(program, "normalise_segmented");
+		normalise.setArg(0, histogramBuffer);
+		normalise.setArg(1, cl::Buffer());
+		normalise.setArg(2, totals);
+		normalise.setArg(3, firsts);
+		normalise.setArg(4, bitsBuffer);
+
+		equalise = cl::Kernel(program, "equalise_coarse");
+		equalise.setArg(0, dev_image_input);
+		equalise.setArg(1, dev_image_output);
+		equalise.setArg(2, histogramBuffer);
+		equalise.setArg(3, binDiv);
+		equalise.setArg(4, countBuffer);
+
+		pack = cl::Kernel(program, bytesPerPixel == 2 ? "pack16" : "pack8");
+		pack.setArg(0, dev_image_output);
+		pack.setArg(1, dev_image_raw);
+
+		// default shape, replaced by the tuned one when a tuning database is given
+		histogramShape.local = min((size_t)256, histogram.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		equaliseShape.local = min((size_t)256, equalise.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		if (tuning != NULL) {
+
+			// tunes on a blank image so every trial reads valid bins
+			queue.enqueueFillBuffer(dev_image_input, 0u, 0, pixels * sizeof(unsigned int));
+			histogramShape = tuning->Tune(queue, histogram, pixels, { 1, 2, 4, 8, 16 }, [&]() {
+				queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+			});
+			equaliseShape = tuning->Tune(queue, equalise, pixels, { 1, 2, 4, 8, 16 });
+		}
+	}
+
+	// equalises one image of the planned shape, in and out may point to the same memory
+	void execute(const void* in, void* out) {
+		size_t planeBytes = pixels * bytesPerPixel;
+
+		queue.enqueueWriteBuffer(dev_image_raw, CL_FALSE, 0, planeBytes, in);
+		enqueueStages();
+
+		// copies the other channels through while the device works
+		if (channels > 1 && in != out) {
+			memcpy((unsigned char*)out + planeBytes, (const unsigned char*)in + planeBytes, planeBytes * (channels - 1));
+		}
+
+		queue.enqueueReadBuffer(dev_image_raw, CL_TRUE, 0, planeBytes, out);
+	}
+
+	// equalises an image the caller already holds in a buffer, such as shared memory wrapped with CL_MEM_USE_HOST_PTR
+	// the first channel is overwritten in place and the other channels are left untouched, so nothing is copied on the host
+	void execute(cl::Buffer& image) {
+		unpack.setArg(0, image);
+		pack.setArg(1, image);
+		enqueueStages();
+
+		// mapping makes the result visible in the host memory behind the buffer
+		void* mapped = queue.enqueueMapBuffer(image, CL_TRUE, CL_MAP_READ, 0, pixels * bytesPerPixel);
+		queue.enqueueUnmapMemObject(image, mapped);
+		queue.finish();
+
+		unpack.setArg(0, dev_image_raw);
+		pack.setArg(1, dev_image_raw);
+	}
+
+private:
+
+	// enqueues every stage from the packed raw image back to the packed raw image
+	void enqueueStages() {
+		queue.enqueueNDRangeKernel(unpack, cl::NullRange, cl::NDRange(pixels), cl::NullRange);
+		queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+		queue.enqueueNDRangeKernel(histogram, cl::NullRange, histogramShape.Global(pixels), cl::NDRange(histogramShape.local));
+		queue.enqueueNDRangeKernel(scan, cl::NullRange, cl::NDRange(scanLocal), cl::NDRange(scanLocal));
+		queue.enqueueNDRangeKernel(normalise, cl::NullRange, cl::NDRange(bins, 1), cl::NullRange);
+		queue.enqueueNDRangeKernel(equalise, cl::NullRange, equaliseShape.Global(pixels), cl::NDRange(equaliseShape.local));
+		queue.enqueueNDRangeKernel(pack, cl::NullRange, cl::NDRange(pixels), cl::NullRange);
+	}
+
+	cl::Context context;
+	cl::CommandQueue queue;
+
+	unsigned int channels;
+	unsigned int bins;
+	unsigned int bits;
+	size_t bytesPerPixel;
+	size_t pixels;
+	int scanLocal;
+
+	cl::Buffer dev_image_raw;
+	cl::Buffer dev_image_input;
+	cl::Buffer dev_image_output;
+	cl::Buffer histogramBuffer;
+
+	cl::Kernel unpack;
+	cl::Kernel histogram;
+	cl::Kernel scan;
+	cl::Kernel normalise;
+	cl::Kernel equalise;
+	cl::Kernel pack;
+
+	LaunchConfig histogramShape;
+	LaunchConfig equaliseShape;
+};
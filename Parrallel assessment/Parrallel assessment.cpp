@@ -3,81 +3,2816 @@
 #include <vector>
 #include <chrono>
 #include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+
+#include <map>
+#include <memory>
+#include <tuple>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+#endif
 
 #include "Utils.h"
 #include "CImg.h"
+#include "EqualisationPlan.h"
+#include "Equaliser.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
 
 using namespace cimg_library;
 
+// timeline of every profiled event and host span in the run, only recorded when -T is given
+Trace trace;
+
+// device buffers recycled across stages and images, set up once the device is known
+BufferPool pool;
+
+// every kernel in my_kernels.cl, created once after the program is built
+KernelRegistry registry;
+
 // calculates for cumulative sum for a group of local cumulative sums
-std::vector<unsigned int> localsum(vector<unsigned int> pixels, vector<unsigned int> sums, int LocalSize, cl::Context context, cl::CommandQueue queue, cl::Program program) {
+std::vector<unsigned int> localsum(vector<unsigned int> pixels, vector<unsigned int> sums, int LocalSize, cl::CommandQueue queue) {
 	
 	std::cout << "" << endl;
 	std::cout << "Cumulative sum carried out on local memory, sum of cumulative sum required" << endl;
 
-	// calculates value to add to each local group
-	for (int i = 1; i < sums.size(); i++) {
-		sums[i] += sums[i - 1];
+	// calculates value to add to each local group
+	for (int i = 1; i < sums.size(); i++) {
+		sums[i] += sums[i - 1];
+	}
+
+	cl::Event pixelTransfer;
+	cl::Event sumsTransfer;
+	cl::Event sumEvent;
+	cl::Event outputTansfer;
+
+
+	// creates buffer for pixels and local sums and write buffers to memeory
+	cl::Buffer pixelsBuffer = pool.Acquire(pixels.size() * sizeof(unsigned int));
+	cl::Buffer sumsBuffer = pool.Acquire(sums.size() * sizeof(unsigned int));
+	queue.enqueueWriteBuffer(pixelsBuffer, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), &pixels[0], NULL, &pixelTransfer);
+	queue.enqueueWriteBuffer(sumsBuffer, CL_TRUE, 0, sums.size() * sizeof(unsigned int), &sums[0], NULL, &sumsTransfer);
+
+	// creates and sets arugments for kernel which calculates cumulative sum
+	RegisteredKernel& sum_Kernel = registry["local_Sum"];
+	sum_Kernel.Bind(0, pixelsBuffer);
+	sum_Kernel.Bind(1, sumsBuffer);
+
+	// runs kernel with an offset to above adding the wrong sum to each group
+	queue.enqueueNDRangeKernel(sum_Kernel.kernel, cl::NDRange(LocalSize), cl::NDRange(pixels.size()), cl::NDRange(LocalSize), NULL, &sumEvent);
+	// reads output histogram from the buffer
+	queue.enqueueReadBuffer(pixelsBuffer, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), pixels.data(), NULL, &outputTansfer);
+
+	trace.AddEvent("local sum write", pixelTransfer);
+	trace.AddEvent("local sum sums write", sumsTransfer);
+	trace.AddEvent("local_Sum", sumEvent);
+	trace.AddEvent("local sum read", outputTansfer);
+
+	// outputs runtime
+	std::cout << GetFullProfilingInfo(sumEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Image transfer time [ns]:" << pixelTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - pixelTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+	std::cout << "binsize transfer time [ns]:" << sumsTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sumsTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+	std::cout << "Output transfer time [ns]:" << outputTansfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputTansfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+	
+
+	pool.Release(pixelsBuffer);
+	pool.Release(sumsBuffer);
+
+	// returns cumulative histogram back to main program
+	return pixels;
+}
+
+// values each work item of blelloch_local scans, passed to my_kernels.cl as SCAN_ITEMS when the program is built
+const int scanItems = 4;
+const string scanOptions = "-DSCAN_ITEMS=" + std::to_string(scanItems);
+
+// runs an inclusive scan of n values entirely on the device, recursing on the group sums
+// uses the work efficient blelloch_local when n is a multiple of scanItems and the Hillis-Steele scan otherwise
+void deviceScan(cl::Buffer& in, cl::Buffer& out, int n, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device, cl::Event* event = NULL) {
+
+	if (n % scanItems == 0) {
+
+		// blelloch_local scans in place
+		if (in() != out()) {
+			queue.enqueueCopyBuffer(in, out, 0, 0, n * sizeof(unsigned int));
+		}
+		RegisteredKernel& Blelloch_kernel = registry["blelloch_local"];
+
+		// work groups are a power of two so the scan tree is balanced, each covers LocalSize * scanItems values
+		int LocalSize = gcd(n / scanItems, Blelloch_kernel.workGroupSize);
+		LocalSize &= -LocalSize;
+		unsigned int span = LocalSize * scanItems;
+		int groups = n / span;
+
+		// sets arguments and runs kernel, the local array is padded against bank conflicts
+		cl::Buffer sumsBuffer = pool.Acquire(groups * sizeof(unsigned int));
+		Blelloch_kernel.Bind(0, out);
+		Blelloch_kernel.Bind(1, sumsBuffer);
+		Blelloch_kernel.Set(2, cl::Local((LocalSize + LocalSize / 32) * sizeof(unsigned int)));
+		queue.enqueueNDRangeKernel(Blelloch_kernel.kernel, cl::NullRange, cl::NDRange(n / scanItems), cl::NDRange(LocalSize), NULL, event);
+
+		// adds the scanned group totals to every group apart from the first
+		if (groups > 1) {
+			deviceScan(sumsBuffer, sumsBuffer, groups, context, queue, program, device);
+			cl::Buffer spanBuffer = pool.Acquire(sizeof(unsigned int));
+			queue.enqueueWriteBuffer(spanBuffer, CL_TRUE, 0, sizeof(unsigned int), &span);
+			RegisteredKernel& add_Kernel = registry["scan_add"];
+			add_Kernel.Bind(0, out);
+			add_Kernel.Bind(1, sumsBuffer);
+			add_Kernel.Bind(2, spanBuffer);
+			queue.enqueueNDRangeKernel(add_Kernel.kernel, cl::NDRange(span), cl::NDRange(n - span), cl::NullRange);
+			pool.Release(spanBuffer);
+		}
+		pool.Release(sumsBuffer);
+		return;
+	}
+
+	// kernel for local Hillis-steele scan
+	RegisteredKernel& Cumulative_kernel = registry["hs_local"];
+
+	// calculates optimim bin size for kernel
+	int LocalSize = gcd(n, Cumulative_kernel.workGroupSize);
+	int groups = n / LocalSize;
+
+	// creates buffer to store local cumulative sums
+	cl::Buffer sumsBuffer = pool.Acquire(groups * sizeof(unsigned int));
+
+	// sets arguments for kernel and runs kernel
+	Cumulative_kernel.Bind(0, in);
+	Cumulative_kernel.Bind(1, out);
+	Cumulative_kernel.Bind(2, sumsBuffer);
+	Cumulative_kernel.Set(3, cl::Local(LocalSize * sizeof(unsigned int)));
+	Cumulative_kernel.Set(4, cl::Local(LocalSize * sizeof(unsigned int)));
+	queue.enqueueNDRangeKernel(Cumulative_kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(LocalSize), NULL, event);
+
+	// sums up local groups if the previous kernel ran with more than one workgroup
+	if (groups > 1) {
+
+		// scans the group sums so each group knows the total of every group before it
+		cl::Buffer scannedSums = pool.Acquire(groups * sizeof(unsigned int));
+		deviceScan(sumsBuffer, scannedSums, groups, context, queue, program, device);
+
+		// adds the sums to every group apart from the first
+		RegisteredKernel& sum_Kernel = registry["local_Sum"];
+		sum_Kernel.Bind(0, out);
+		sum_Kernel.Bind(1, scannedSums);
+		queue.enqueueNDRangeKernel(sum_Kernel.kernel, cl::NDRange(LocalSize), cl::NDRange(n - LocalSize), cl::NDRange(LocalSize));
+		pool.Release(scannedSums);
+	}
+	pool.Release(sumsBuffer);
+}
+
+// builds a normalised look up table from a histogram without leaving the device
+void deviceLUT(cl::Buffer& histogramBuffer, cl::Buffer& lutBuffer, cl::Buffer& bitsBuffer, unsigned int bins, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	// cumulative histogram is written straight into the look up table
+	deviceScan(histogramBuffer, lutBuffer, bins, context, queue, program, device);
+
+	// finds min and max of the cumulative histogram
+	cl::Buffer minNumBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer maxNumBuffer = pool.Acquire(sizeof(unsigned int));
+	RegisteredKernel& Bounds_kernel = registry["cdf_bounds"];
+	Bounds_kernel.Bind(0, lutBuffer);
+	Bounds_kernel.Bind(1, minNumBuffer);
+	Bounds_kernel.Bind(2, maxNumBuffer);
+	queue.enqueueNDRangeKernel(Bounds_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+
+	// normalises the cumulative histogram in place
+	RegisteredKernel& Normalise_kernel = registry["normalise"];
+	Normalise_kernel.Bind(0, lutBuffer);
+	Normalise_kernel.Bind(1, minNumBuffer);
+	Normalise_kernel.Bind(2, maxNumBuffer);
+	Normalise_kernel.Bind(3, bitsBuffer);
+	queue.enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+	pool.Release(minNumBuffer);
+	pool.Release(maxNumBuffer);
+}
+
+// scans many histograms stored in one buffer with a single launch
+// offsets may be an empty buffer when the histograms are packed back to back
+void segmentedScan(cl::Buffer& in, cl::Buffer& out, cl::Buffer offsets, cl::Buffer& totals, cl::Buffer& firsts, unsigned int segments, unsigned int bins, cl::CommandQueue queue, cl::Event* event = NULL) {
+
+	// kernel for the segmented scan
+	RegisteredKernel& Scan_kernel = registry["scan_segmented"];
+
+	// one work group per segment, each work item scans bins / LocalSize entries
+	int LocalSize = gcd(bins, Scan_kernel.workGroupSize);
+
+	cl::Buffer binsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bins);
+
+	// sets arguments and runs kernel
+	Scan_kernel.Bind(0, in);
+	Scan_kernel.Bind(1, out);
+	Scan_kernel.Bind(2, offsets);
+	Scan_kernel.Bind(3, totals);
+	Scan_kernel.Bind(4, firsts);
+	Scan_kernel.Bind(5, binsBuffer);
+	Scan_kernel.Set(6, cl::Local(LocalSize * sizeof(unsigned int)));
+	queue.enqueueNDRangeKernel(Scan_kernel.kernel, cl::NullRange, cl::NDRange(segments * LocalSize), cl::NDRange(LocalSize), NULL, event);
+	pool.Release(binsBuffer);
+}
+
+// turns many histograms stored in one buffer into normalised look up tables in place
+void segmentedLUT(cl::Buffer& histograms, cl::Buffer offsets, unsigned int segments, unsigned int bins, cl::Buffer& bitsBuffer, cl::CommandQueue queue, cl::Event* event = NULL) {
+
+	// stores the total and first non zero bin of every segment
+	cl::Buffer totals = pool.Acquire(segments * sizeof(unsigned int));
+	cl::Buffer firsts = pool.Acquire(segments * sizeof(unsigned int));
+
+	// scans every histogram in place
+	segmentedScan(histograms, histograms, offsets, totals, firsts, segments, bins, queue, event);
+
+	// normalises every histogram with one work item per bin per segment
+	RegisteredKernel& Normalise_kernel = registry["normalise_segmented"];
+	Normalise_kernel.Bind(0, histograms);
+	Normalise_kernel.Bind(1, offsets);
+	Normalise_kernel.Bind(2, totals);
+	Normalise_kernel.Bind(3, firsts);
+	Normalise_kernel.Bind(4, bitsBuffer);
+	queue.enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(bins, segments), cl::NullRange);
+	pool.Release(totals);
+	pool.Release(firsts);
+}
+
+// adds the histogram of the pixels to a 64 bit histogram, only widening the per work group counts when they are merged
+// sizesBuffer holds the number of pixels and bins and groupsBuffer the number of groups, so they are only written when they change
+void deviceHistogram64(cl::Buffer& input, cl::Buffer& sizesBuffer, cl::Buffer& partials, unsigned int groups, cl::Buffer& groupsBuffer, cl::Buffer& histogram64, cl::Buffer& binDiv, unsigned int bins, cl::CommandQueue queue, cl::Device device) {
+
+	// local memory counters are used when the histogram fits
+	bool local = bins * sizeof(unsigned int) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	RegisteredKernel& histogram_Kernel = registry[local ? "histogram_partial" : "histogram_partial_global"];
+
+	// each group only sees a share of the pixels so its 32 bit counts can not wrap
+	int LocalSize = min(256, (int)histogram_Kernel.workGroupSize);
+
+	// the global variant counts straight into the partial slices so they start at zero
+	if (!local) {
+		queue.enqueueFillBuffer(partials, 0u, 0, groups * bins * sizeof(unsigned int));
+	}
+
+	histogram_Kernel.Bind(0, input);
+	histogram_Kernel.Bind(1, partials);
+	histogram_Kernel.Bind(2, binDiv);
+	histogram_Kernel.Bind(3, sizesBuffer);
+	if (local) {
+		histogram_Kernel.Set(4, cl::Local(bins * sizeof(unsigned int)));
+	}
+	queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(groups * LocalSize), cl::NDRange(LocalSize));
+
+	// merges the group histograms into the 64 bit histogram
+	RegisteredKernel& Merge_kernel = registry["histogram_merge64"];
+	Merge_kernel.Bind(0, partials);
+	Merge_kernel.Bind(1, histogram64);
+	Merge_kernel.Bind(2, groupsBuffer);
+	queue.enqueueNDRangeKernel(Merge_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+}
+
+// builds a normalised 32 bit look up table from a 64 bit histogram without leaving the device
+void deviceLUT64(cl::Buffer& histogram64, cl::Buffer& lutBuffer, cl::Buffer& bitsBuffer, unsigned int bins, cl::CommandQueue queue) {
+
+	// takes buffers for the 64 bit cumulative histogram and its min and max from the pool
+	cl::Buffer cumulative64 = pool.Acquire(bins * sizeof(cl_ulong));
+	cl::Buffer bounds = pool.Acquire(2 * sizeof(cl_ulong));
+	cl::Buffer binsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bins);
+
+	// scans the whole histogram with one work group
+	RegisteredKernel& Scan_kernel = registry["scan64"];
+	int LocalSize = gcd(bins, Scan_kernel.workGroupSize);
+	Scan_kernel.Bind(0, histogram64);
+	Scan_kernel.Bind(1, cumulative64);
+	Scan_kernel.Bind(2, bounds);
+	Scan_kernel.Bind(3, binsBuffer);
+	Scan_kernel.Set(4, cl::Local(LocalSize * sizeof(cl_ulong)));
+	queue.enqueueNDRangeKernel(Scan_kernel.kernel, cl::NullRange, cl::NDRange(LocalSize), cl::NDRange(LocalSize));
+
+	// normalises into the 32 bit look up table used by equalise
+	RegisteredKernel& Normalise_kernel = registry["normalise64"];
+	Normalise_kernel.Bind(0, cumulative64);
+	Normalise_kernel.Bind(1, lutBuffer);
+	Normalise_kernel.Bind(2, bounds);
+	Normalise_kernel.Bind(3, bitsBuffer);
+	queue.enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+	pool.Release(cumulative64);
+	pool.Release(bounds);
+	pool.Release(binsBuffer);
+}
+
+// rough largest difference between a cumulative histogram built from a sample and the exact one, as a fraction of the pixels
+// this is the Dvoretzky-Kiefer-Wolfowitz bound at 99%, which assumes independent samples, the sampled histogram takes one
+// pixel at a random position in each block instead, so the bound is only an approximation for that stratified sample
+double sampledCdfBound(size_t samples) {
+	return std::sqrt(std::log(2.0 / 0.01) / (2.0 * samples));
+}
+
+// picks how many pixels the histogram skips between samples, falling back to every pixel when the bound is over the tolerance
+unsigned int sampleStride(size_t count, unsigned int sampleEvery, float tolerance) {
+	if (sampleEvery <= 1) {
+		return 1;
+	}
+	double bound = sampledCdfBound((count + sampleEvery - 1) / sampleEvery);
+	if (bound > tolerance) {
+		std::cout << "Sampling 1 in " << sampleEvery << " pixels gives an estimated cumulative histogram error of " << bound << ", over the tolerance of " << tolerance << ", using every pixel" << endl;
+		return 1;
+	}
+	std::cout << "Sampling 1 in " << sampleEvery << " pixels, estimated cumulative histogram error " << bound << " (approximate, stratified sample)" << endl;
+	return sampleEvery;
+}
+
+// enqueues a histogram of one in every stride pixels with the counts scaled up by the stride, the histogram must start cleared
+// the position sampled in each block is moved by a new seed every call, so repeated runs do not always skip the same pixels
+void sampledHistogram(cl::Buffer& image, cl::Buffer& histogram, cl::Buffer& binDiv, unsigned int count, unsigned int stride, cl::CommandQueue queue, cl::Event* event = NULL) {
+	static std::mt19937 seeds(std::random_device{}());
+	unsigned int seed = seeds();
+	cl::Buffer countBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer strideBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer seedBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(unsigned int), &count);
+	queue.enqueueWriteBuffer(strideBuffer, CL_TRUE, 0, sizeof(unsigned int), &stride);
+	queue.enqueueWriteBuffer(seedBuffer, CL_TRUE, 0, sizeof(unsigned int), &seed);
+
+	RegisteredKernel& Sampled_kernel = registry["histogram_sampled"];
+	Sampled_kernel.Bind(0, image);
+	Sampled_kernel.Bind(1, histogram);
+	Sampled_kernel.Bind(2, binDiv);
+	Sampled_kernel.Bind(3, countBuffer);
+	Sampled_kernel.Bind(4, strideBuffer);
+	Sampled_kernel.Bind(5, seedBuffer);
+	queue.enqueueNDRangeKernel(Sampled_kernel.kernel, cl::NullRange, cl::NDRange((count + stride - 1) / stride), cl::NullRange, NULL, event);
+	pool.Release(countBuffer);
+	pool.Release(strideBuffer);
+	pool.Release(seedBuffer);
+}
+
+// checks a number of bins can be used with a number of intensity levels, every bin has to cover the same number of levels
+bool validBins(unsigned int bits, unsigned int bins) {
+	return bins != 0 && bins <= bits && bits % bins == 0;
+}
+
+// equalises a sequence of frames, only rebuilding the look up table when the histogram drifts
+void streamEqualise(string framePattern, unsigned int bits, unsigned int bins, float threshold, float alpha, unsigned int sampleEvery, float tolerance, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	// calculates the number used to define which bin and intensity belongs too
+	unsigned int binsDivider = bits / bins;
+
+	// buffers which stay on the device for the whole stream
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer alphaBuffer = pool.Acquire(sizeof(float));
+	cl::Buffer histogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer referenceBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer lutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer newLutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer distanceBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+	queue.enqueueWriteBuffer(alphaBuffer, CL_TRUE, 0, sizeof(float), &alpha);
+
+	// kernels come from the registry, the buffers are bound before each launch as other stages share the kernels
+	RegisteredKernel& histogram_Kernel = registry["histogram"];
+	RegisteredKernel& Distance_kernel = registry["hist_distance"];
+	RegisteredKernel& Blend_kernel = registry["lut_blend"];
+	RegisteredKernel& Equalise = registry["equalise"];
+
+	// image buffers are only swapped for pooled ones of the new size if the frame size changes
+	cl::Buffer dev_image_input;
+	cl::Buffer dev_image_output;
+	size_t frameSize = 0;
+	unsigned int stride = 1;
+
+	int rebuilds = 0;
+	int frame = 0;
+	char filename[512];
+
+	while (true) {
+
+		// stops once the next frame in the sequence can not be found
+		snprintf(filename, sizeof(filename), framePattern.c_str(), frame);
+		if (!ifstream(filename).good()) {
+			break;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		// loads the frame, only the intensity of colour frames is equalised
+		CImg<unsigned short> image_input(filename);
+		bool colour = image_input.spectrum() == 3;
+		if (colour) {
+			image_input = image_input.RGBtoYCbCr();
+		}
+		std::vector<unsigned int> pixels(image_input.begin(), image_input.begin() + (size_t)image_input.width() * image_input.height() * image_input.depth());
+
+		if (pixels.size() != frameSize) {
+			if (frameSize != 0) {
+				pool.Release(dev_image_input);
+				pool.Release(dev_image_output);
+			}
+			frameSize = pixels.size();
+			stride = sampleStride(frameSize, sampleEvery, tolerance);
+			dev_image_input = pool.Acquire(frameSize * sizeof(unsigned int));
+			dev_image_output = pool.Acquire(frameSize * sizeof(unsigned int));
+		}
+
+		// calculates the histogram of the frame, from a sample when the error bound allows it
+		queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, frameSize * sizeof(unsigned int), &pixels[0]);
+		queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+		if (stride > 1) {
+			sampledHistogram(dev_image_input, histogramBuffer, binDiv, (unsigned int)frameSize, stride, queue);
+		}
+		else {
+			histogram_Kernel.Bind(0, dev_image_input);
+			histogram_Kernel.Bind(1, histogramBuffer);
+			histogram_Kernel.Bind(2, binDiv);
+			queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(frameSize), cl::NullRange);
+		}
+
+		// compares the frame to the histogram the current look up table was built from
+		bool rebuild = (frame == 0);
+		float distance = 0;
+		if (!rebuild) {
+			unsigned int difference = 0;
+			queue.enqueueFillBuffer(distanceBuffer, 0u, 0, sizeof(unsigned int));
+			Distance_kernel.Bind(0, histogramBuffer);
+			Distance_kernel.Bind(1, referenceBuffer);
+			Distance_kernel.Bind(2, distanceBuffer);
+			queue.enqueueNDRangeKernel(Distance_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			queue.enqueueReadBuffer(distanceBuffer, CL_TRUE, 0, sizeof(unsigned int), &difference);
+
+			// fraction of the pixels which have changed bin, each moved pixel is counted once leaving a bin and once arriving in another
+			distance = (float)difference / 2 / frameSize;
+			rebuild = distance > threshold;
+		}
+
+		if (rebuild) {
+			rebuilds++;
+
+			// the first frame has nothing to blend with
+			if (frame == 0) {
+				deviceLUT(histogramBuffer, lutBuffer, bitsBuffer, bins, context, queue, program, device);
+			}
+			else {
+				deviceLUT(histogramBuffer, newLutBuffer, bitsBuffer, bins, context, queue, program, device);
+				Blend_kernel.Bind(0, lutBuffer);
+				Blend_kernel.Bind(1, newLutBuffer);
+				Blend_kernel.Bind(2, alphaBuffer);
+				queue.enqueueNDRangeKernel(Blend_kernel.kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			}
+
+			// this histogram becomes the reference for future frames
+			queue.enqueueCopyBuffer(histogramBuffer, referenceBuffer, 0, 0, bins * sizeof(unsigned int));
+		}
+
+		// equalises the frame with the current look up table
+		std::vector<unsigned int> output_buffer(frameSize);
+		Equalise.Bind(0, dev_image_input);
+		Equalise.Bind(1, dev_image_output);
+		Equalise.Bind(2, lutBuffer);
+		Equalise.Bind(3, binDiv);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(frameSize), cl::NullRange);
+		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, frameSize * sizeof(unsigned int), output_buffer.data());
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
+		std::cout << "Frame " << frame << " distance " << distance << (rebuild ? " rebuilt" : " reused") << " look up table, took " << duration.count() << " NS" << endl;
+
+		// writes the equalised intensity back over the first plane and reconverts colour frames
+		std::copy(output_buffer.begin(), output_buffer.end(), image_input.begin());
+		if (colour) {
+			image_input = image_input.YCbCrtoRGB();
+		}
+
+		// saves the equalised frame
+		snprintf(filename, sizeof(filename), colour ? "Equalised_%04d.ppm" : "Equalised_%04d.pgm", frame);
+		if (bits == 65536) {
+			image_input.save(filename);
+		}
+		else {
+			CImg<unsigned char>(image_input).save(filename);
+		}
+
+		frame++;
+	}
+
+	if (frameSize != 0) {
+		pool.Release(dev_image_input);
+		pool.Release(dev_image_output);
+	}
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+	pool.Release(alphaBuffer);
+	pool.Release(histogramBuffer);
+	pool.Release(referenceBuffer);
+	pool.Release(lutBuffer);
+	pool.Release(newLutBuffer);
+	pool.Release(distanceBuffer);
+
+	std::cout << "Equalised " << frame << " frames, look up table rebuilt " << rebuilds << " times" << endl;
+}
+
+// equalises an image with contrast limited adaptive histogram equalisation over a grid of tiles
+std::vector<unsigned int> claheEqualise(std::vector<unsigned int>& pixels, unsigned int width, unsigned int height, unsigned int bits, unsigned int bins, unsigned int tiles, float clipFactor, cl::CommandQueue queue, cl::Device device) {
+
+	// each tile histogram is counted in local memory so it has to fit
+	if (bins * sizeof(unsigned int) > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+		throw cl::Error(CL_OUT_OF_RESOURCES, "CLAHE histogram does not fit in local memory, use fewer bins");
+	}
+
+	// calculates the number used to define which bin and intensity belongs too
+	unsigned int binsDivider = bits / bins;
+
+	// clip limit is a multiple of the average bin count of a tile
+	unsigned int tileW = (width + tiles - 1) / tiles;
+	unsigned int tileH = (height + tiles - 1) / tiles;
+	unsigned int clip = max(1u, (unsigned int)(clipFactor * tileW * tileH / bins));
+
+	// packs the sizes needed by every CLAHE kernel
+	std::vector<unsigned int> params = { width, height, tiles, tiles, clip, bins };
+
+	// creates events to track runtime
+	cl::Event HistEvent;
+	cl::Event LutEvent;
+	cl::Event EqEvent;
+
+	// takes buffers for the image, the tile look up tables and the parameters from the pool and writes them
+	cl::Buffer dev_image_input = pool.Acquire(pixels.size() * sizeof(unsigned int));
+	cl::Buffer dev_image_output = pool.Acquire(pixels.size() * sizeof(unsigned int));
+	cl::Buffer tileBuffer = pool.Acquire(tiles * tiles * bins * sizeof(unsigned int));
+	cl::Buffer paramsBuffer = pool.Acquire(params.size() * sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), &pixels[0]);
+	queue.enqueueWriteBuffer(paramsBuffer, CL_TRUE, 0, params.size() * sizeof(unsigned int), &params[0]);
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+
+	// counts and clips a histogram per tile, one 8x8 work group per tile
+	RegisteredKernel& Histogram_kernel = registry["clahe_histogram"];
+	Histogram_kernel.Bind(0, dev_image_input);
+	Histogram_kernel.Bind(1, tileBuffer);
+	Histogram_kernel.Bind(2, binDiv);
+	Histogram_kernel.Bind(3, paramsBuffer);
+	Histogram_kernel.Set(4, cl::Local(bins * sizeof(unsigned int)));
+	queue.enqueueNDRangeKernel(Histogram_kernel.kernel, cl::NullRange, cl::NDRange(tiles * 8, tiles * 8), cl::NDRange(8, 8), NULL, &HistEvent);
+
+	// scans and normalises every tile histogram in one launch
+	segmentedLUT(tileBuffer, cl::Buffer(), tiles * tiles, bins, bitsBuffer, queue, &LutEvent);
+
+	// equalises every pixel from the four nearest tiles
+	RegisteredKernel& Equalise_kernel = registry["clahe_equalise"];
+	Equalise_kernel.Bind(0, dev_image_input);
+	Equalise_kernel.Bind(1, dev_image_output);
+	Equalise_kernel.Bind(2, tileBuffer);
+	Equalise_kernel.Bind(3, binDiv);
+	Equalise_kernel.Bind(4, paramsBuffer);
+	queue.enqueueNDRangeKernel(Equalise_kernel.kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, NULL, &EqEvent);
+
+	// reads results from buffer, after which the buffers can go back to the pool
+	std::vector<unsigned int> output(pixels.size());
+	queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output.size() * sizeof(unsigned int), output.data());
+	pool.Release(dev_image_input);
+	pool.Release(dev_image_output);
+	pool.Release(tileBuffer);
+	pool.Release(paramsBuffer);
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+
+	// outputs runtime of each stage
+	std::cout << "Tile histogram " << GetFullProfilingInfo(HistEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Tile scan " << GetFullProfilingInfo(LutEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Interpolated equalise " << GetFullProfilingInfo(EqEvent, ProfilingResolution::PROF_NS) << std::endl;
+
+	return output;
+}
+
+// a read only memory mapped file
+struct MappedFile {
+	const unsigned char* data = NULL;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int file = -1;
+#endif
+};
+
+// maps a whole file into memory so it can be read a tile at a time without loading it
+bool mapFile(string filename, MappedFile& mapped) {
+#ifdef _WIN32
+	mapped.file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapped.file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(mapped.file, &size);
+	mapped.size = size.QuadPart;
+	mapped.mapping = CreateFileMappingA(mapped.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapped.mapping == NULL) {
+		return false;
+	}
+	mapped.data = (const unsigned char*)MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	mapped.file = open(filename.c_str(), O_RDONLY);
+	if (mapped.file < 0) {
+		return false;
+	}
+	struct stat info;
+	fstat(mapped.file, &info);
+	mapped.size = info.st_size;
+	void* data = mmap(NULL, mapped.size, PROT_READ, MAP_PRIVATE, mapped.file, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	// tiles are read in order so the kernel can read ahead
+	madvise(data, mapped.size, MADV_SEQUENTIAL);
+	mapped.data = (const unsigned char*)data;
+#endif
+	return mapped.data != NULL;
+}
+
+// releases a memory mapped file
+void unmapFile(MappedFile& mapped) {
+#ifdef _WIN32
+	if (mapped.data != NULL) UnmapViewOfFile(mapped.data);
+	if (mapped.mapping != NULL) CloseHandle(mapped.mapping);
+	if (mapped.file != INVALID_HANDLE_VALUE) CloseHandle(mapped.file);
+#else
+	if (mapped.data != NULL) munmap((void*)mapped.data, mapped.size);
+	if (mapped.file >= 0) close(mapped.file);
+#endif
+	mapped = MappedFile();
+}
+
+// reads a header value from a binary pgm, skipping whitespace and comments
+size_t pgmValue(const MappedFile& mapped, size_t& position) {
+	while (position < mapped.size && (isspace(mapped.data[position]) || mapped.data[position] == '#')) {
+		if (mapped.data[position] == '#') {
+			while (position < mapped.size && mapped.data[position] != '\n') position++;
+		}
+		else {
+			position++;
+		}
+	}
+	size_t value = 0;
+	while (position < mapped.size && isdigit(mapped.data[position])) {
+		value = value * 10 + (mapped.data[position++] - '0');
+	}
+	return value;
+}
+
+// copies a run of pixels out of the mapped pgm, 16 bit pgms are stored big endian
+void pgmPixels(const unsigned char* data, size_t count, bool wide, std::vector<unsigned int>& pixels) {
+	for (size_t i = 0; i < count; i++) {
+		pixels[i] = wide ? (data[i * 2] << 8) | data[i * 2 + 1] : data[i];
+	}
+}
+
+// equalises a binary pgm of any size by streaming it through fixed size tiles on the device
+void tiledEqualise(string image_filename, unsigned int bins, size_t tilePixels, bool wideCounts, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	// maps the input rather than loading it so host memory stays bounded
+	MappedFile mapped;
+	if (!mapFile(image_filename, mapped) || mapped.size < 2 || mapped.data[0] != 'P' || mapped.data[1] != '5') {
+		unmapFile(mapped);
+		std::cout << "Tiled mode needs a binary pgm image" << endl;
+		return;
+	}
+
+	// reads the header, a single whitespace character separates it from the pixels
+	size_t position = 2;
+	size_t width = pgmValue(mapped, position);
+	size_t height = pgmValue(mapped, position);
+	size_t maxValue = pgmValue(mapped, position);
+	position++;
+
+	bool wide = maxValue > 255;
+	unsigned int bits = wide ? 65536 : 256;
+	size_t bytesPerPixel = wide ? 2 : 1;
+
+	// checks the header against the size of the file before any tile is read, dividing so a huge header can not wrap
+	if (width == 0 || height == 0 || maxValue == 0 || maxValue > 65535 || position > mapped.size || (mapped.size - position) / bytesPerPixel / width < height) {
+		unmapFile(mapped);
+		std::cout << "The pgm header does not match the size of " << image_filename << endl;
+		return;
+	}
+	size_t imageSize = width * height;
+
+	// the bins were checked against -b, the depth of the file itself is only known now
+	if (!validBins(bits, bins)) {
+		unmapFile(mapped);
+		std::cerr << "ERROR: " << bins << " bins does not divide the " << bits << " levels of " << image_filename << std::endl;
+		return;
+	}
+	unsigned int binsDivider = bits / bins;
+
+	// tiles can not be bigger than the device allows a single buffer to be
+	tilePixels = min(tilePixels, (size_t)(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / sizeof(unsigned int)));
+	tilePixels = min(tilePixels, imageSize);
+	size_t tileCount = (imageSize + tilePixels - 1) / tilePixels;
+	std::cout << "Streaming " << imageSize << " pixels through " << tileCount << " tiles of " << tilePixels << " pixels" << endl;
+
+	// 32 bit counts wrap once an image has more than 4294967295 pixels
+	wideCounts = wideCounts || imageSize > UINT_MAX;
+	if (wideCounts) {
+		std::cout << "Using 64 bit histogram counts" << endl;
+	}
+
+	// the only image sized buffers are one tile in and one tile out, two of each so transfers overlap kernels
+	cl::Buffer tileInput[2] = { pool.Acquire(tilePixels * sizeof(unsigned int)), pool.Acquire(tilePixels * sizeof(unsigned int)) };
+	cl::Buffer tileOutput[2] = { pool.Acquire(tilePixels * sizeof(unsigned int)), pool.Acquire(tilePixels * sizeof(unsigned int)) };
+	std::vector<unsigned int> staging[2] = { std::vector<unsigned int>(tilePixels), std::vector<unsigned int>(tilePixels) };
+	cl::Event stagingFree[2];
+
+	cl::Buffer histogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer lutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+	queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+
+	// 64 bit histogram and the per work group 32 bit histograms merged into it
+	unsigned int groups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+	cl::Buffer histogram64 = pool.Acquire(bins * sizeof(cl_ulong));
+	cl::Buffer partials = pool.Acquire(groups * bins * sizeof(unsigned int));
+	queue.enqueueFillBuffer(histogram64, (cl_ulong)0, 0, bins * sizeof(cl_ulong));
+
+	// every tile but the last is full, so the sizes are only rewritten for the last one
+	unsigned int sizes[2] = { (unsigned int)tilePixels, bins };
+	cl::Buffer sizesBuffer = pool.Acquire(sizeof(sizes));
+	cl::Buffer groupsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(sizesBuffer, CL_TRUE, 0, sizeof(sizes), sizes);
+	queue.enqueueWriteBuffer(groupsBuffer, CL_TRUE, 0, sizeof(unsigned int), &groups);
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// first pass accumulates every tile into the same histogram on the device
+	RegisteredKernel& histogram_Kernel = registry["histogram"];
+	for (size_t tile = 0; tile < tileCount; tile++) {
+		int slot = tile % 2;
+		size_t first = tile * tilePixels;
+		size_t count = min(tilePixels, imageSize - first);
+
+		// waits until the previous transfer from this slot has finished with its staging memory
+		if (stagingFree[slot]()) {
+			stagingFree[slot].wait();
+		}
+		pgmPixels(mapped.data + position + first * bytesPerPixel, count, wide, staging[slot]);
+
+		queue.enqueueWriteBuffer(tileInput[slot], CL_FALSE, 0, count * sizeof(unsigned int), &staging[slot][0], NULL, &stagingFree[slot]);
+		if (wideCounts) {
+			if (count != sizes[0]) {
+				sizes[0] = count;
+				queue.enqueueWriteBuffer(sizesBuffer, CL_TRUE, 0, sizeof(sizes), sizes);
+			}
+			deviceHistogram64(tileInput[slot], sizesBuffer, partials, groups, groupsBuffer, histogram64, binDiv, bins, queue, device);
+		}
+		else {
+			histogram_Kernel.Bind(0, tileInput[slot]);
+			histogram_Kernel.Bind(1, histogramBuffer);
+			histogram_Kernel.Bind(2, binDiv);
+			queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(count), cl::NullRange);
+		}
+	}
+
+	// the look up table is only built once for the whole image
+	if (wideCounts) {
+		deviceLUT64(histogram64, lutBuffer, bitsBuffer, bins, queue);
+	}
+	else {
+		deviceLUT(histogramBuffer, lutBuffer, bitsBuffer, bins, context, queue, program, device);
+	}
+
+	// the output is written a tile at a time in the same format as the input
+	ofstream outFile("Equalised.pgm", ios::binary);
+	outFile << "P5\n" << width << " " << height << "\n" << maxValue << "\n";
+	std::vector<unsigned char> outBytes(tilePixels * bytesPerPixel);
+
+	// writes an equalised tile once its read back into staging has finished
+	auto writeTile = [&](int slot, size_t count) {
+		stagingFree[slot].wait();
+		for (size_t i = 0; i < count; i++) {
+			if (wide) {
+				outBytes[i * 2] = staging[slot][i] >> 8;
+				outBytes[i * 2 + 1] = staging[slot][i] & 0xFF;
+			}
+			else {
+				outBytes[i] = staging[slot][i];
+			}
+		}
+		outFile.write((const char*)outBytes.data(), count * bytesPerPixel);
+	};
+
+	// second pass streams the tiles again to equalise them
+	RegisteredKernel& Equalise = registry["equalise"];
+	for (size_t tile = 0; tile < tileCount; tile++) {
+		int slot = tile % 2;
+		size_t first = tile * tilePixels;
+		size_t count = min(tilePixels, imageSize - first);
+
+		// the tile before last was written out during the previous iteration, so only its read has to finish
+		if (stagingFree[slot]()) {
+			stagingFree[slot].wait();
+		}
+		pgmPixels(mapped.data + position + first * bytesPerPixel, count, wide, staging[slot]);
+
+		queue.enqueueWriteBuffer(tileInput[slot], CL_FALSE, 0, count * sizeof(unsigned int), &staging[slot][0], NULL, &stagingFree[slot]);
+		Equalise.Bind(0, tileInput[slot]);
+		Equalise.Bind(1, tileOutput[slot]);
+		Equalise.Bind(2, lutBuffer);
+		Equalise.Bind(3, binDiv);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(count), cl::NullRange);
+
+		// reads the tile back without blocking, the previous tile is written out while this one is on the device
+		queue.enqueueReadBuffer(tileOutput[slot], CL_FALSE, 0, count * sizeof(unsigned int), &staging[slot][0], NULL, &stagingFree[slot]);
+		if (tile > 0) {
+			writeTile(1 - slot, tilePixels);
+		}
+	}
+
+	// only the last tile can be short
+	writeTile((tileCount - 1) % 2, imageSize - (tileCount - 1) * tilePixels);
+
+	unmapFile(mapped);
+	for (int slot = 0; slot < 2; slot++) {
+		pool.Release(tileInput[slot]);
+		pool.Release(tileOutput[slot]);
+	}
+	pool.Release(histogramBuffer);
+	pool.Release(lutBuffer);
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+	pool.Release(histogram64);
+	pool.Release(partials);
+	pool.Release(sizesBuffer);
+	pool.Release(groupsBuffer);
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
+	std::cout << "Tiled equalise took " << duration.count() << " NS, written to Equalised.pgm" << endl;
+}
+
+// equalises a list of images packed into one buffer, so the whole batch costs a handful of launches
+void batchEqualise(string listFile, unsigned int bits, unsigned int bins, cl::CommandQueue queue) {
+
+	// reads the list of images
+	std::vector<string> filenames;
+	ifstream list(listFile);
+	string line;
+	while (std::getline(list, line)) {
+		if (!line.empty()) {
+			filenames.push_back(line);
+		}
+	}
+
+	if (filenames.empty()) {
+		std::cout << "No images listed in " << listFile << endl;
+		return;
+	}
+
+	// loads every image and packs its intensity values back to back
+	std::vector<CImg<unsigned short>> images;
+	std::vector<unsigned int> pixels;
+	std::vector<unsigned int> offsets;
+	for (int i = 0; i < filenames.size(); i++) {
+		CImg<unsigned short> image(filenames[i].c_str());
+
+		// only the intensity of colour images is equalised
+		if (image.spectrum() == 3) {
+			image = image.RGBtoYCbCr();
+		}
+
+		offsets.push_back(pixels.size());
+		pixels.insert(pixels.end(), image.begin(), image.begin() + image.width() * image.height() * image.depth());
+		images.push_back(image);
+	}
+
+	unsigned int count = images.size();
+	unsigned int binsDivider = bits / bins;
+
+	// creates events to track runtime
+	cl::Event inIamgeTransfer;
+	cl::Event HistEvent;
+	cl::Event ScanEvent;
+	cl::Event EqEvent;
+	cl::Event EqOutEvent;
+
+	// creates and writes buffers for the packed images, offset table and look up tables
+	cl::Buffer dev_image_input = pool.Acquire(pixels.size() * sizeof(unsigned int));
+	cl::Buffer dev_image_output = pool.Acquire(pixels.size() * sizeof(unsigned int));
+	cl::Buffer histogramBuffer = pool.Acquire(count * bins * sizeof(unsigned int));
+	cl::Buffer offsetsBuffer = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer countBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer binsBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, pixels.size() * sizeof(unsigned int), &pixels[0], NULL, &inIamgeTransfer);
+	queue.enqueueWriteBuffer(offsetsBuffer, CL_FALSE, 0, count * sizeof(unsigned int), &offsets[0]);
+	queue.enqueueWriteBuffer(countBuffer, CL_FALSE, 0, sizeof(unsigned int), &count);
+	queue.enqueueWriteBuffer(binsBuffer, CL_FALSE, 0, sizeof(unsigned int), &bins);
+	queue.enqueueWriteBuffer(binDiv, CL_FALSE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_FALSE, 0, sizeof(unsigned int), &bits);
+	queue.enqueueFillBuffer(histogramBuffer, 0u, 0, count * bins * sizeof(unsigned int));
+
+	// counts every image's histogram into its own slice in one launch
+	RegisteredKernel& histogram_Kernel = registry["histogram_batch"];
+	histogram_Kernel.Bind(0, dev_image_input);
+	histogram_Kernel.Bind(1, histogramBuffer);
+	histogram_Kernel.Bind(2, binDiv);
+	histogram_Kernel.Bind(3, offsetsBuffer);
+	histogram_Kernel.Bind(4, countBuffer);
+	histogram_Kernel.Bind(5, binsBuffer);
+	queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(pixels.size()), cl::NullRange, NULL, &HistEvent);
+
+	// turns every histogram into a look up table
+	segmentedLUT(histogramBuffer, cl::Buffer(), count, bins, bitsBuffer, queue, &ScanEvent);
+
+	// equalises every image in one launch
+	RegisteredKernel& Equalise = registry["equalise_batch"];
+	Equalise.Bind(0, dev_image_input);
+	Equalise.Bind(1, dev_image_output);
+	Equalise.Bind(2, histogramBuffer);
+	Equalise.Bind(3, binDiv);
+	Equalise.Bind(4, offsetsBuffer);
+	Equalise.Bind(5, countBuffer);
+	Equalise.Bind(6, binsBuffer);
+	queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(pixels.size()), cl::NullRange, NULL, &EqEvent);
+
+	// reads results from buffer
+	std::vector<unsigned int> output_buffer(pixels.size());
+	queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_buffer.size() * sizeof(unsigned int), output_buffer.data(), NULL, &EqOutEvent);
+	pool.Release(dev_image_input);
+	pool.Release(dev_image_output);
+	pool.Release(histogramBuffer);
+	pool.Release(offsetsBuffer);
+	pool.Release(countBuffer);
+	pool.Release(binsBuffer);
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+
+	// outputs runtime of each stage
+	std::cout << "Batch of " << count << " images, " << pixels.size() << " pixels" << endl;
+	std::cout << "Image transfer time [ns]:" << inIamgeTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inIamgeTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+	std::cout << "Batch histogram " << GetFullProfilingInfo(HistEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Batch scan " << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Batch equalise " << GetFullProfilingInfo(EqEvent, ProfilingResolution::PROF_NS) << std::endl;
+	std::cout << "Output transfer time [ns]:" << EqOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - EqOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+
+	// unpacks and saves each equalised image
+	char filename[512];
+	for (int i = 0; i < count; i++) {
+		CImg<unsigned short>& image = images[i];
+		std::copy(output_buffer.begin() + offsets[i], output_buffer.begin() + offsets[i] + image.width() * image.height() * image.depth(), image.begin());
+
+		// reconverts colour space of colour image
+		if (image.spectrum() == 3) {
+			image = image.YCbCrtoRGB();
+		}
+
+		snprintf(filename, sizeof(filename), "Batch_%04d.%s", i, image.spectrum() == 3 ? "ppm" : "pgm");
+		if (bits == 65536) {
+			image.save(filename);
+		}
+		else {
+			CImg<unsigned char>(image).save(filename);
+		}
+	}
+}
+
+
+
+
+// time taken by a profiled command in nanoseconds
+double eventTime(const cl::Event& evnt) {
+	return (double)(evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+}
+
+// one timed run of a stage variant in nanoseconds, serial variants only have kernel and total time
+struct StageSample {
+	double kernel = 0;
+	double transfer = 0;
+	double total = 0;
+};
+
+// the median, 95th percentile and minimum of a set of timings
+struct TimingStats {
+	double median = 0;
+	double p95 = 0;
+	double min = 0;
+};
+
+TimingStats timingStats(std::vector<double> values) {
+	TimingStats stats;
+	if (values.empty()) {
+		return stats;
+	}
+	std::sort(values.begin(), values.end());
+	stats.median = values[values.size() / 2];
+	stats.p95 = values[(size_t)ceil(values.size() * 0.95) - 1];
+	stats.min = values.front();
+	return stats;
+}
+
+// one row of the benchmark results
+struct BenchmarkResult {
+	string input;
+	size_t pixels;
+	unsigned int bins;
+	string stage;
+	string variant;
+	TimingStats kernel;
+	TimingStats transfer;
+	TimingStats total;
+};
+
+// runs a stage variant to warm up, then times it for the given number of repetitions
+BenchmarkResult benchmarkStage(string input, size_t pixels, unsigned int bins, string stage, string variant, int warmup, int reps, std::function<StageSample()> run) {
+	for (int i = 0; i < warmup; i++) {
+		run();
+	}
+
+	std::vector<double> kernel, transfer, total;
+	for (int i = 0; i < reps; i++) {
+		StageSample sample = run();
+		kernel.push_back(sample.kernel);
+		transfer.push_back(sample.transfer);
+		total.push_back(sample.total);
+	}
+
+	std::cout << input << " " << stage << " " << variant << " median " << timingStats(total).median << " NS" << endl;
+	return { input, pixels, bins, stage, variant, timingStats(kernel), timingStats(transfer), timingStats(total) };
+}
+
+// times every variant of every stage on one image
+// stages are timed separately as each variant gets the same input, so any combination costs the sum of its stages
+void benchmarkImage(string input, std::vector<unsigned int>& pixels, unsigned int bits, unsigned int bins, int warmup, int reps, std::vector<BenchmarkResult>& results, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	unsigned int binsDivider = bits / bins;
+	size_t imageBytes = pixels.size() * sizeof(unsigned int);
+	size_t binBytes = bins * sizeof(unsigned int);
+
+	// reference results passed between stages so every variant of a stage starts from the same data
+	std::vector<unsigned int> histogramData(bins);
+	for (int i = 0; i < pixels.size(); i++) {
+		histogramData[pixels[i] / binsDivider]++;
+	}
+	std::vector<unsigned int> CumulativeHistogramData = histogramData;
+	for (int i = 1; i < CumulativeHistogramData.size(); i++) {
+		CumulativeHistogramData[i] += CumulativeHistogramData[i - 1];
+	}
+	unsigned int maxNum = CumulativeHistogramData.back() / 10;
+	// an empty image has no non zero count, the minimum falls back to 0
+	std::vector<unsigned int>::iterator firstCount = std::find_if(CumulativeHistogramData.begin(), CumulativeHistogramData.end(), [](unsigned int v) { return v != 0; });
+	unsigned int minNum = firstCount == CumulativeHistogramData.end() ? 0 : *firstCount / 10;
+	std::vector<unsigned int> NormalisedHistogramData(bins);
+	for (int i = 1; i < bins; i++) {
+		if (CumulativeHistogramData[i] != 0) {
+			NormalisedHistogramData[i] = (double)(CumulativeHistogramData[i] / 10 - minNum) / (maxNum - minNum) * (bits - 1);
+		}
+	}
+
+	// sizes of work groups for the single group scans
+	size_t hsGroup = cl::Kernel(program, "hs").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	size_t blellochGroup = cl::Kernel(program, "blelloch").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+	////////////////////////////////////////////////////////
+	/////////////// Histogram
+	////////////////////////////////////////////////////////
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "histogram", "serial", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> hist(bins);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < pixels.size(); i++) {
+			hist[pixels[i] / binsDivider]++;
+		}
+		sample.total = sample.kernel = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		return sample;
+	}));
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "histogram", "parallel", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> hist(bins);
+		cl::Event inEvent, divEvent, clearEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, imageBytes);
+		cl::Buffer binDiv(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer histogramBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, imageBytes, &pixels[0], NULL, &inEvent);
+		queue.enqueueWriteBuffer(binDiv, CL_FALSE, 0, sizeof(unsigned int), &binsDivider, NULL, &divEvent);
+		queue.enqueueFillBuffer(histogramBuffer, 0u, 0, binBytes, NULL, &clearEvent);
+
+		cl::Kernel histogram_Kernel(program, "histogram");
+		histogram_Kernel.setArg(0, dev_image_input);
+		histogram_Kernel.setArg(1, histogramBuffer);
+		histogram_Kernel.setArg(2, binDiv);
+		queue.enqueueNDRangeKernel(histogram_Kernel, cl::NullRange, cl::NDRange(pixels.size()), cl::NullRange, NULL, &kernelEvent);
+		queue.enqueueReadBuffer(histogramBuffer, CL_TRUE, 0, binBytes, hist.data(), NULL, &outEvent);
+
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel = eventTime(kernelEvent);
+		sample.transfer = eventTime(inEvent) + eventTime(divEvent) + eventTime(clearEvent) + eventTime(outEvent);
+		return sample;
+	}));
+
+	////////////////////////////////////////////////////////
+	/////////////// Cumulative histogram
+	////////////////////////////////////////////////////////
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "scan", "serial", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> hist = histogramData;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 1; i < hist.size(); i++) {
+			hist[i] += hist[i - 1];
+		}
+		sample.total = sample.kernel = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		return sample;
+	}));
+
+	// runs a scan kernel on the histogram, local variants add the group sums back with local_Sum
+	auto scanVariant = [&](string kernelName, bool local, bool separateOutput) {
+		StageSample sample;
+		std::vector<unsigned int> cumulative(bins);
+		cl::Event inEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		cl::Buffer ChistogramBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		cl::Buffer OuthistogramBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		queue.enqueueWriteBuffer(ChistogramBuffer, CL_FALSE, 0, binBytes, &histogramData[0], NULL, &inEvent);
+
+		cl::Kernel Cumulative_kernel(program, kernelName.c_str());
+		int LocalSize = local ? gcd(bins, Cumulative_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) : bins;
+		int groups = bins / LocalSize;
+		cl::Buffer sumsBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(unsigned int));
+
+		int arg = 0;
+		Cumulative_kernel.setArg(arg++, ChistogramBuffer);
+		if (separateOutput) Cumulative_kernel.setArg(arg++, OuthistogramBuffer);
+		if (local) {
+			Cumulative_kernel.setArg(arg++, sumsBuffer);
+			Cumulative_kernel.setArg(arg++, cl::Local(LocalSize * sizeof(unsigned int)));
+			if (separateOutput) Cumulative_kernel.setArg(arg++, cl::Local(LocalSize * sizeof(unsigned int)));
+		}
+		queue.enqueueNDRangeKernel(Cumulative_kernel, cl::NullRange, cl::NDRange(bins), cl::NDRange(LocalSize), NULL, &kernelEvent);
+		cl::Buffer& result = separateOutput ? OuthistogramBuffer : ChistogramBuffer;
+
+		// adds the sums of the earlier groups to each group
+		if (groups > 1) {
+			cl::Event sumsOutEvent, sumsInEvent, sumEvent;
+			std::vector<unsigned int> groupSums(groups);
+			queue.enqueueReadBuffer(sumsBuffer, CL_TRUE, 0, groups * sizeof(unsigned int), groupSums.data(), NULL, &sumsOutEvent);
+			for (int i = 1; i < groups; i++) {
+				groupSums[i] += groupSums[i - 1];
+			}
+			queue.enqueueWriteBuffer(sumsBuffer, CL_FALSE, 0, groups * sizeof(unsigned int), groupSums.data(), NULL, &sumsInEvent);
+
+			cl::Kernel sum_Kernel(program, "local_Sum");
+			sum_Kernel.setArg(0, result);
+			sum_Kernel.setArg(1, sumsBuffer);
+			queue.enqueueNDRangeKernel(sum_Kernel, cl::NDRange(LocalSize), cl::NDRange(bins - LocalSize), cl::NDRange(LocalSize), NULL, &sumEvent);
+			queue.finish();
+			sample.kernel += eventTime(sumEvent);
+			sample.transfer += eventTime(sumsOutEvent) + eventTime(sumsInEvent);
+		}
+
+		queue.enqueueReadBuffer(result, CL_TRUE, 0, binBytes, cumulative.data(), NULL, &outEvent);
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel += eventTime(kernelEvent);
+		sample.transfer += eventTime(inEvent) + eventTime(outEvent);
+		return sample;
+	};
+
+	// single work group scans only work while the histogram fits in one work group
+	if (bins <= hsGroup) {
+		results.push_back(benchmarkStage(input, pixels.size(), bins, "scan", "hillis-steele global", warmup, reps, [&]() { return scanVariant("hs", false, true); }));
+	}
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "scan", "hillis-steele local", warmup, reps, [&]() { return scanVariant("hs_local", true, true); }));
+	if (bins <= blellochGroup) {
+		results.push_back(benchmarkStage(input, pixels.size(), bins, "scan", "blelloch global", warmup, reps, [&]() { return scanVariant("blelloch", false, false); }));
+	}
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "scan", "blelloch local", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> cumulative(bins);
+		cl::Event inEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		// the work efficient scan adds the group totals on the device
+		cl::Buffer ChistogramBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		queue.enqueueWriteBuffer(ChistogramBuffer, CL_FALSE, 0, binBytes, &histogramData[0], NULL, &inEvent);
+		deviceScan(ChistogramBuffer, ChistogramBuffer, bins, context, queue, program, device, &kernelEvent);
+		queue.enqueueReadBuffer(ChistogramBuffer, CL_TRUE, 0, binBytes, cumulative.data(), NULL, &outEvent);
+
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel = eventTime(kernelEvent);
+		sample.transfer = eventTime(inEvent) + eventTime(outEvent);
+		return sample;
+	}));
+
+	////////////////////////////////////////////////////////
+	/////////////// Max and Min numbers
+	////////////////////////////////////////////////////////
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "min", "serial", warmup, reps, [&]() {
+		StageSample sample;
+		auto start = std::chrono::high_resolution_clock::now();
+		unsigned int minimum = 0;
+		for (int i = 0; i < CumulativeHistogramData.size() && minimum == 0; i++) {
+			minimum = CumulativeHistogramData[i];
+		}
+		sample.total = sample.kernel = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		return sample;
+	}));
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "min", "parallel", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> minStorage(bins);
+		cl::Event inEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		cl::Buffer numberBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		queue.enqueueWriteBuffer(numberBuffer, CL_FALSE, 0, binBytes, &CumulativeHistogramData[0], NULL, &inEvent);
+		cl::Kernel Reduce(program, "reduce");
+		Reduce.setArg(0, numberBuffer);
+		// reduce only runs as a single work group
+		int LocalSize = gcd(bins, Reduce.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+		queue.enqueueNDRangeKernel(Reduce, cl::NullRange, cl::NDRange(LocalSize), cl::NDRange(LocalSize), NULL, &kernelEvent);
+		queue.enqueueReadBuffer(numberBuffer, CL_TRUE, 0, binBytes, minStorage.data(), NULL, &outEvent);
+
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel = eventTime(kernelEvent);
+		sample.transfer = eventTime(inEvent) + eventTime(outEvent);
+		return sample;
+	}));
+
+	////////////////////////////////////////////////////////
+	/////////////// Histogram normalisaiton
+	////////////////////////////////////////////////////////
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "normalise", "serial", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> normalised(bins);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 1; i < bins; i++) {
+			if (CumulativeHistogramData[i] != 0) {
+				normalised[i] = (double)(CumulativeHistogramData[i] / 10 - minNum) / (maxNum - minNum) * (bits - 1);
+			}
+		}
+		sample.total = sample.kernel = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		return sample;
+	}));
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "normalise", "parallel", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> normalised(bins);
+		cl::Event inEvent, minEvent, maxEvent, bitsEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		cl::Buffer NhistogramBuffer(context, CL_MEM_READ_WRITE, binBytes);
+		cl::Buffer minNumBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer maxNumBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer bitsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		queue.enqueueWriteBuffer(NhistogramBuffer, CL_FALSE, 0, binBytes, &CumulativeHistogramData[0], NULL, &inEvent);
+		queue.enqueueWriteBuffer(minNumBuffer, CL_FALSE, 0, sizeof(unsigned int), &minNum, NULL, &minEvent);
+		queue.enqueueWriteBuffer(maxNumBuffer, CL_FALSE, 0, sizeof(unsigned int), &maxNum, NULL, &maxEvent);
+		queue.enqueueWriteBuffer(bitsBuffer, CL_FALSE, 0, sizeof(unsigned int), &bits, NULL, &bitsEvent);
+
+		cl::Kernel Normalise_kernel(program, "normalise");
+		Normalise_kernel.setArg(0, NhistogramBuffer);
+		Normalise_kernel.setArg(1, minNumBuffer);
+		Normalise_kernel.setArg(2, maxNumBuffer);
+		Normalise_kernel.setArg(3, bitsBuffer);
+		queue.enqueueNDRangeKernel(Normalise_kernel, cl::NullRange, cl::NDRange(bins), cl::NullRange, NULL, &kernelEvent);
+		queue.enqueueReadBuffer(NhistogramBuffer, CL_TRUE, 0, binBytes, normalised.data(), NULL, &outEvent);
+
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel = eventTime(kernelEvent);
+		sample.transfer = eventTime(inEvent) + eventTime(minEvent) + eventTime(maxEvent) + eventTime(bitsEvent) + eventTime(outEvent);
+		return sample;
+	}));
+
+	////////////////////////////////////////////////////////
+	/////////////// Image equalisation
+	////////////////////////////////////////////////////////
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "equalise", "serial", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> output(pixels.size());
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < pixels.size(); i++) {
+			output[i] = NormalisedHistogramData[pixels[i] / binsDivider];
+		}
+		sample.total = sample.kernel = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		return sample;
+	}));
+
+	results.push_back(benchmarkStage(input, pixels.size(), bins, "equalise", "parallel", warmup, reps, [&]() {
+		StageSample sample;
+		std::vector<unsigned int> output(pixels.size());
+		cl::Event inEvent, divEvent, histEvent, kernelEvent, outEvent;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, imageBytes);
+		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, imageBytes);
+		cl::Buffer binDiv(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		cl::Buffer BPhistogramBuffer(context, CL_MEM_READ_ONLY, binBytes);
+		queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, imageBytes, &pixels[0], NULL, &inEvent);
+		queue.enqueueWriteBuffer(binDiv, CL_FALSE, 0, sizeof(unsigned int), &binsDivider, NULL, &divEvent);
+		queue.enqueueWriteBuffer(BPhistogramBuffer, CL_FALSE, 0, binBytes, &NormalisedHistogramData[0], NULL, &histEvent);
+
+		cl::Kernel Equalise(program, "equalise");
+		Equalise.setArg(0, dev_image_input);
+		Equalise.setArg(1, dev_image_output);
+		Equalise.setArg(2, BPhistogramBuffer);
+		Equalise.setArg(3, binDiv);
+		queue.enqueueNDRangeKernel(Equalise, cl::NullRange, cl::NDRange(pixels.size()), cl::NullRange, NULL, &kernelEvent);
+		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, imageBytes, output.data(), NULL, &outEvent);
+
+		sample.total = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		sample.kernel = eventTime(kernelEvent);
+		sample.transfer = eventTime(inEvent) + eventTime(divEvent) + eventTime(histEvent) + eventTime(outEvent);
+		return sample;
+	}));
+}
+
+// benchmarks every stage variant over the sample images and a range of synthetic image sizes
+void runBenchmark(unsigned int bits, unsigned int bins, int reps, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	// the sample images are copied next to the executable by the post build step
+	std::vector<string> samples = { "test.pgm", "Bingus.pgm", "bird_colour.ppm", "grass.ppm" };
+	std::vector<unsigned int> syntheticSizes = { 64, 512, 2048, 4096 };
+	int warmup = 2;
+
+	std::vector<BenchmarkResult> results;
+
+	for (int i = 0; i < samples.size(); i++) {
+		if (!ifstream(samples[i]).good()) {
+			std::cout << "Skipping missing sample " << samples[i] << endl;
+			continue;
+		}
+
+		// only the intensity of colour images is equalised
+		CImg<unsigned short> image(samples[i].c_str());
+		if (image.spectrum() == 3) {
+			image = image.RGBtoYCbCr();
+		}
+		std::vector<unsigned int> pixels(image.begin(), image.begin() + image.width() * image.height() * image.depth());
+
+		// keeps the values inside the chosen bit depth
+		for (int j = 0; j < pixels.size(); j++) {
+			pixels[j] = min(pixels[j], bits - 1);
+		}
+		benchmarkImage(samples[i], pixels, bits, bins, warmup, reps, results, context, queue, program, device);
+	}
+
+	// synthetic square images of uniformly random intensities
+	std::mt19937 generator(0);
+	std::uniform_int_distribution<unsigned int> intensity(0, bits - 1);
+	for (int i = 0; i < syntheticSizes.size(); i++) {
+		std::vector<unsigned int> pixels(syntheticSizes[i] * syntheticSizes[i]);
+		for (int j = 0; j < pixels.size(); j++) {
+			pixels[j] = intensity(generator);
+		}
+		benchmarkImage("synthetic_" + std::to_string(syntheticSizes[i]), pixels, bits, bins, warmup, reps, results, context, queue, program, device);
+	}
+
+	// writes the results as csv
+	ofstream csvFile("Benchmark.csv");
+	csvFile << "input,pixels,bins,stage,variant,kernel_median_ns,kernel_p95_ns,kernel_min_ns,transfer_median_ns,transfer_p95_ns,transfer_min_ns,total_median_ns,total_p95_ns,total_min_ns" << endl;
+	for (int i = 0; i < results.size(); i++) {
+		BenchmarkResult& r = results[i];
+		csvFile << r.input << "," << r.pixels << "," << r.bins << "," << r.stage << "," << r.variant << ","
+			<< r.kernel.median << "," << r.kernel.p95 << "," << r.kernel.min << ","
+			<< r.transfer.median << "," << r.transfer.p95 << "," << r.transfer.min << ","
+			<< r.total.median << "," << r.total.p95 << "," << r.total.min << endl;
+	}
+
+	// writes the results as json
+	auto statsJson = [](const TimingStats& stats) {
+		stringstream sstream;
+		sstream << "{\"median\": " << stats.median << ", \"p95\": " << stats.p95 << ", \"min\": " << stats.min << "}";
+		return sstream.str();
+	};
+	ofstream jsonFile("Benchmark.json");
+	jsonFile << "{\"device\": \"" << device.getInfo<CL_DEVICE_NAME>() << "\", \"repetitions\": " << reps << ", \"warmup\": " << warmup << ", \"results\": [" << endl;
+	for (int i = 0; i < results.size(); i++) {
+		BenchmarkResult& r = results[i];
+		jsonFile << "  {\"input\": \"" << r.input << "\", \"pixels\": " << r.pixels << ", \"bins\": " << r.bins
+			<< ", \"stage\": \"" << r.stage << "\", \"variant\": \"" << r.variant
+			<< "\", \"kernel_ns\": " << statsJson(r.kernel) << ", \"transfer_ns\": " << statsJson(r.transfer) << ", \"total_ns\": " << statsJson(r.total) << "}"
+			<< (i + 1 < results.size() ? "," : "") << endl;
+	}
+	jsonFile << "]}" << endl;
+
+	std::cout << "Benchmark results written to Benchmark.csv and Benchmark.json" << endl;
+}
+
+// equalises the same image many times through one plan, showing the per call cost once setup is paid
+template <typename T>
+void planRepeat(CImg<T> image, unsigned int bitDepth, unsigned int bins, int repeats, TuningDatabase* tuning, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+
+	// only the intensity of colour images is equalised
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+
+	auto planStart = std::chrono::high_resolution_clock::now();
+	EqualisationPlan plan(context, device, queue, program, image.width(), image.height() * image.depth(), image.spectrum(), bitDepth, bins, tuning);
+	auto planEnd = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("plan", planStart, planEnd);
+
+	CImg<T> output(image.width(), image.height(), image.depth(), image.spectrum());
+	for (int i = 0; i < repeats; i++) {
+		plan.execute(image.data(), output.data());
+	}
+	auto executeEnd = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("execute", planEnd, executeEnd);
+
+	auto planTime = std::chrono::duration_cast<std::chrono::nanoseconds>(planEnd - planStart);
+	auto executeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(executeEnd - planEnd);
+	std::cout << "Plan took " << planTime.count() << " NS, " << repeats << " executions averaged " << executeTime.count() / repeats << " NS each" << endl;
+
+	if (colour) {
+		output = output.YCbCrtoRGB();
+	}
+	output.save(colour ? "Equalised.ppm" : "Equalised.pgm");
+}
+
+// splits a device into one sub device per NUMA node, or returns the device alone when it can not be split that way
+std::vector<cl::Device> numaSubDevices(cl::Device device) {
+	std::vector<cl::Device> subDevices;
+
+	// OpenCL 1.1 devices do not know the query and fail it
+	cl_device_affinity_domain domains = 0;
+	try {
+		domains = device.getInfo<CL_DEVICE_PARTITION_AFFINITY_DOMAIN>();
+	}
+	catch (const cl::Error& err) {
+		std::cout << "NUMA affinity query failed: " << getErrorString(err.err()) << endl;
+	}
+	if (domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA) {
+		cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+		try {
+			device.createSubDevices(properties, &subDevices);
+		}
+		catch (const cl::Error& err) {
+			std::cout << "NUMA fission failed: " << getErrorString(err.err()) << endl;
+			subDevices.clear();
+		}
+	}
+	if (subDevices.empty()) {
+		std::cout << "Device can not be split by NUMA node, running on the whole device" << endl;
+		subDevices.push_back(device);
+	}
+	return subDevices;
+}
+
+// splits the image into row bands across every device in the context, sized by each device's measured throughput
+// each device counts its band, the partial histograms are merged and every device then equalises its own band
+// with localFirstTouch each band's buffers are first written by its own device so a CPU driver places them on that device's node
+void multiDeviceEqualise(string image_filename, unsigned int bits, unsigned int bins, cl::Context context, cl::Program program, bool localFirstTouch = false) {
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	size_t deviceCount = devices.size();
+
+	// only the intensity of colour images is equalised
+	CImg<unsigned short> image(image_filename.c_str());
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+	unsigned int width = image.width();
+	unsigned int height = image.height() * image.depth();
+	std::vector<unsigned int> pixels(image.begin(), image.begin() + (size_t)width * height);
+	for (int i = 0; i < pixels.size(); i++) {
+		pixels[i] = min(pixels[i], bits - 1);
+	}
+
+	unsigned int binsDivider = bits / bins;
+	std::vector<cl::CommandQueue> queues;
+
+	// each device gets its own kernels, created once, so their arguments and work group limits are per device
+	std::vector<KernelRegistry> kernels;
+	std::vector<cl::Buffer> binDivs;
+	for (int d = 0; d < deviceCount; d++) {
+		queues.push_back(cl::CommandQueue(context, devices[d], CL_QUEUE_PROFILING_ENABLE));
+		kernels.push_back(KernelRegistry(program, devices[d]));
+		binDivs.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int)));
+		queues[d].enqueueWriteBuffer(binDivs[d], CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	}
+
+	// times a histogram of the first rows on each device to weight the bands
+	unsigned int sampleRows = max(1u, min(height, (unsigned int)(1000000 / max(1u, width))));
+	unsigned int sampleCount = sampleRows * width;
+	std::vector<double> throughput(deviceCount);
+	double totalThroughput = 0;
+	for (int d = 0; d < deviceCount; d++) {
+		cl::Buffer sampleBuffer(context, CL_MEM_READ_ONLY, sampleCount * sizeof(unsigned int));
+		cl::Buffer sampleHistogram(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+		cl::Buffer countBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		queues[d].enqueueWriteBuffer(sampleBuffer, CL_TRUE, 0, sampleCount * sizeof(unsigned int), pixels.data());
+		queues[d].enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(unsigned int), &sampleCount);
+		queues[d].enqueueFillBuffer(sampleHistogram, 0u, 0, bins * sizeof(unsigned int));
+
+		RegisteredKernel& histogram_Kernel = kernels[d]["histogram_coarse"];
+		histogram_Kernel.Bind(0, sampleBuffer);
+		histogram_Kernel.Bind(1, sampleHistogram);
+		histogram_Kernel.Bind(2, binDivs[d]);
+		histogram_Kernel.Bind(3, countBuffer);
+		size_t LocalSize = min((size_t)256, histogram_Kernel.workGroupSize);
+		cl::Event SampleEvent;
+		queues[d].enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(((sampleCount + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize), NULL, &SampleEvent);
+		SampleEvent.wait();
+
+		throughput[d] = sampleCount / max(1.0, eventTime(SampleEvent));
+		totalThroughput += throughput[d];
+	}
+
+	// row bands proportional to throughput, the last device takes whatever rounding leaves
+	std::vector<unsigned int> firstRow(deviceCount + 1, 0);
+	for (int d = 0; d < deviceCount; d++) {
+		unsigned int rows = (d + 1 == deviceCount) ? height - firstRow[d] : (unsigned int)(height * throughput[d] / totalThroughput);
+		firstRow[d + 1] = min(height, firstRow[d] + rows);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// every device counts its own band, all queues run at once
+	std::vector<cl::Buffer> bandInputs(deviceCount);
+	std::vector<cl::Buffer> bandOutputs(deviceCount);
+	std::vector<cl::Buffer> bandCounts(deviceCount);
+	std::vector<cl::Buffer> partials(deviceCount);
+
+	// the band sizes are written without blocking, so they are kept here until every queue has finished
+	std::vector<unsigned int> bandCount(deviceCount);
+	std::vector<std::vector<unsigned int>> partialData(deviceCount, std::vector<unsigned int>(bins));
+	std::vector<cl::Event> HistEvents(deviceCount);
+	for (int d = 0; d < deviceCount; d++) {
+		unsigned int count = (firstRow[d + 1] - firstRow[d]) * width;
+		if (count == 0) {
+			continue;
+		}
+		bandInputs[d] = cl::Buffer(context, CL_MEM_READ_ONLY, count * sizeof(unsigned int));
+		bandOutputs[d] = cl::Buffer(context, CL_MEM_WRITE_ONLY, count * sizeof(unsigned int));
+		bandCounts[d] = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		partials[d] = cl::Buffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+		if (localFirstTouch) {
+			queues[d].enqueueFillBuffer(bandInputs[d], 0u, 0, count * sizeof(unsigned int));
+			queues[d].enqueueFillBuffer(bandOutputs[d], 0u, 0, count * sizeof(unsigned int));
+		}
+		queues[d].enqueueWriteBuffer(bandInputs[d], CL_FALSE, 0, count * sizeof(unsigned int), &pixels[(size_t)firstRow[d] * width]);
+		bandCount[d] = count;
+		queues[d].enqueueWriteBuffer(bandCounts[d], CL_FALSE, 0, sizeof(unsigned int), &bandCount[d]);
+		queues[d].enqueueFillBuffer(partials[d], 0u, 0, bins * sizeof(unsigned int));
+
+		RegisteredKernel& histogram_Kernel = kernels[d]["histogram_coarse"];
+		histogram_Kernel.Bind(0, bandInputs[d]);
+		histogram_Kernel.Bind(1, partials[d]);
+		histogram_Kernel.Bind(2, binDivs[d]);
+		histogram_Kernel.Bind(3, bandCounts[d]);
+		size_t LocalSize = min((size_t)256, histogram_Kernel.workGroupSize);
+		queues[d].enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(((count + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize), NULL, &HistEvents[d]);
+		queues[d].enqueueReadBuffer(partials[d], CL_FALSE, 0, bins * sizeof(unsigned int), partialData[d].data());
+		queues[d].flush();
+	}
+
+	// merges the partial histograms, they are only bins long so this is left to the host
+	std::vector<unsigned int> histogramData(bins, 0);
+	for (int d = 0; d < deviceCount; d++) {
+		queues[d].finish();
+		for (int b = 0; b < bins; b++) {
+			histogramData[b] += partialData[d][b];
+		}
+	}
+
+	// the look up table is built once on the first device and copied to the others
+	cl::Buffer lutBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+	cl::Buffer totals(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+	cl::Buffer firsts(context, CL_MEM_READ_WRITE, sizeof(unsigned int));
+	cl::Buffer binsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	cl::Buffer bitsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+	queues[0].enqueueWriteBuffer(lutBuffer, CL_FALSE, 0, bins * sizeof(unsigned int), histogramData.data());
+	queues[0].enqueueWriteBuffer(binsBuffer, CL_FALSE, 0, sizeof(unsigned int), &bins);
+	queues[0].enqueueWriteBuffer(bitsBuffer, CL_FALSE, 0, sizeof(unsigned int), &bits);
+
+	RegisteredKernel& Scan_kernel = kernels[0]["scan_segmented"];
+	int ScanSize = gcd(bins, Scan_kernel.workGroupSize);
+	Scan_kernel.Bind(0, lutBuffer);
+	Scan_kernel.Bind(1, lutBuffer);
+	Scan_kernel.Bind(2, cl::Buffer());
+	Scan_kernel.Bind(3, totals);
+	Scan_kernel.Bind(4, firsts);
+	Scan_kernel.Bind(5, binsBuffer);
+	Scan_kernel.Set(6, cl::Local(ScanSize * sizeof(unsigned int)));
+	queues[0].enqueueNDRangeKernel(Scan_kernel.kernel, cl::NullRange, cl::NDRange(ScanSize), cl::NDRange(ScanSize));
+
+	RegisteredKernel& Normalise_kernel = kernels[0]["normalise_segmented"];
+	Normalise_kernel.Bind(0, lutBuffer);
+	Normalise_kernel.Bind(1, cl::Buffer());
+	Normalise_kernel.Bind(2, totals);
+	Normalise_kernel.Bind(3, firsts);
+	Normalise_kernel.Bind(4, bitsBuffer);
+	queues[0].enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(bins, 1), cl::NullRange);
+
+	std::vector<unsigned int> lutData(bins);
+	queues[0].enqueueReadBuffer(lutBuffer, CL_TRUE, 0, bins * sizeof(unsigned int), lutData.data());
+
+	// every device equalises its own band
+	std::vector<cl::Buffer> luts(deviceCount);
+	std::vector<cl::Event> EqEvents(deviceCount);
+	std::vector<unsigned int> output(pixels.size());
+	for (int d = 0; d < deviceCount; d++) {
+		unsigned int count = (firstRow[d + 1] - firstRow[d]) * width;
+		if (count == 0) {
+			continue;
+		}
+		luts[d] = cl::Buffer(context, CL_MEM_READ_ONLY, bins * sizeof(unsigned int));
+		queues[d].enqueueWriteBuffer(luts[d], CL_FALSE, 0, bins * sizeof(unsigned int), lutData.data());
+
+		RegisteredKernel& Equalise = kernels[d]["equalise_coarse"];
+		Equalise.Bind(0, bandInputs[d]);
+		Equalise.Bind(1, bandOutputs[d]);
+		Equalise.Bind(2, luts[d]);
+		Equalise.Bind(3, binDivs[d]);
+		Equalise.Bind(4, bandCounts[d]);
+		size_t LocalSize = min((size_t)256, Equalise.workGroupSize);
+		queues[d].enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(((count + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize), NULL, &EqEvents[d]);
+		queues[d].enqueueReadBuffer(bandOutputs[d], CL_FALSE, 0, count * sizeof(unsigned int), &output[(size_t)firstRow[d] * width]);
+		queues[d].flush();
+	}
+	for (int d = 0; d < deviceCount; d++) {
+		queues[d].finish();
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("multi device equalise", start, stop);
+
+	// outputs each device's share and runtime
+	for (int d = 0; d < deviceCount; d++) {
+		std::cout << devices[d].getInfo<CL_DEVICE_NAME>() << ": rows " << firstRow[d] << " - " << firstRow[d + 1];
+		if (firstRow[d + 1] > firstRow[d]) {
+			std::cout << ", histogram " << eventTime(HistEvents[d]) << " NS, equalise " << eventTime(EqEvents[d]) << " NS";
+		}
+		std::cout << endl;
+	}
+	std::cout << "Multi device equalise on " << deviceCount << " devices took " << std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() << " NS" << endl;
+
+	std::copy(output.begin(), output.end(), image.begin());
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	if (bits == 65536) {
+		image.save(colour ? "Equalised.ppm" : "Equalised.pgm");
+	}
+	else {
+		CImg<unsigned char>(image).save(colour ? "Equalised.ppm" : "Equalised.pgm");
+	}
+}
+
+// builds the program for every device of the context and runs multiDeviceEqualise, shared by -D and -N
+void runMultiDevice(string image_filename, unsigned int bits, unsigned int bins, cl::Context context, bool localFirstTouch, string traceFile) {
+	if (!validBins(bits, bins)) {
+		std::cerr << "ERROR: " << bins << " bins does not divide the " << bits << " levels of the bit depth" << std::endl;
+		return;
+	}
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+
+	// host spans are placed on the first device's clock
+	trace.enabled = !traceFile.empty();
+	if (trace.enabled) {
+		cl::CommandQueue traceQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE);
+		trace.Start(traceQueue);
+	}
+
+	cl::Program program = BuildProgram(context, devices, "kernels/my_kernels.cl", scanOptions);
+	multiDeviceEqualise(image_filename, bits, bins, context, program, localFirstTouch);
+	trace.Write(traceFile);
+}
+
+// enqueues the histogram, look up table and equalisation of count pixels, leaving the look up table in lutBuffer
+void enqueueEqualise(cl::Buffer& input, cl::Buffer& output, cl::Buffer& lutBuffer, unsigned int count, unsigned int bins, cl::Buffer& binDiv, cl::Buffer& bitsBuffer, bool buildLUT, cl::CommandQueue queue) {
+	cl::Buffer countBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(unsigned int), &count);
+
+	if (buildLUT) {
+		queue.enqueueFillBuffer(lutBuffer, 0u, 0, bins * sizeof(unsigned int));
+		RegisteredKernel& histogram_Kernel = registry["histogram_coarse"];
+		histogram_Kernel.Bind(0, input);
+		histogram_Kernel.Bind(1, lutBuffer);
+		histogram_Kernel.Bind(2, binDiv);
+		histogram_Kernel.Bind(3, countBuffer);
+		size_t LocalSize = min((size_t)256, histogram_Kernel.workGroupSize);
+		queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(min((size_t)1024, (count + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize));
+
+		// the histogram becomes the look up table in place
+		segmentedLUT(lutBuffer, cl::Buffer(), 1, bins, bitsBuffer, queue);
+	}
+
+	RegisteredKernel& Equalise = registry["equalise_coarse"];
+	Equalise.Bind(0, input);
+	Equalise.Bind(1, output);
+	Equalise.Bind(2, lutBuffer);
+	Equalise.Bind(3, binDiv);
+	Equalise.Bind(4, countBuffer);
+	size_t LocalSize = min((size_t)256, Equalise.workGroupSize);
+	queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(min((size_t)1024, (count + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize));
+	pool.Release(countBuffer);
+}
+
+// shows an equalised preview of a level downsampled by factor as soon as it is ready, then equalises the full image
+// the full pass reuses the preview's look up table unless refine asks for one built from every pixel
+void previewEqualise(string image_filename, unsigned int bits, unsigned int bins, unsigned int factor, bool refine, cl::CommandQueue queue) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// only the intensity of colour images is equalised
+	CImg<unsigned short> image(image_filename.c_str());
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+	unsigned int width = image.width();
+	unsigned int height = image.height() * image.depth();
+	size_t count = (size_t)width * height;
+
+	// the coarse kernels index the image with a 32 bit count
+	if (count > UINT_MAX) {
+		std::cerr << "ERROR: preview mode handles at most " << UINT_MAX << " pixels, " << image_filename << " has " << count << std::endl;
+		return;
+	}
+	factor = min(factor, min(width, height));
+	unsigned int levelWidth = width / factor;
+	unsigned int levelHeight = height / factor;
+	unsigned int levelCount = levelWidth * levelHeight;
+	std::vector<unsigned int> pixels(image.begin(), image.begin() + count);
+	for (size_t i = 0; i < pixels.size(); i++) {
+		pixels[i] = min(pixels[i], bits - 1);
+	}
+
+	unsigned int binsDivider = bits / bins;
+	unsigned int dims[2] = { width, factor };
+	cl::Buffer dev_image_input = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer dev_image_output = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer dev_level_input = pool.Acquire(levelCount * sizeof(unsigned int));
+	cl::Buffer dev_level_output = pool.Acquire(levelCount * sizeof(unsigned int));
+	cl::Buffer lutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer dimsBuffer = pool.Acquire(sizeof(dims));
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+	queue.enqueueWriteBuffer(dimsBuffer, CL_TRUE, 0, sizeof(dims), dims);
+
+	// the image goes to the device once and the level is built there
+	queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, count * sizeof(unsigned int), pixels.data());
+	RegisteredKernel& Downsample_kernel = registry["downsample"];
+	Downsample_kernel.Bind(0, dev_image_input);
+	Downsample_kernel.Bind(1, dev_level_input);
+	Downsample_kernel.Bind(2, dimsBuffer);
+	queue.enqueueNDRangeKernel(Downsample_kernel.kernel, cl::NullRange, cl::NDRange(levelWidth, levelHeight), cl::NullRange);
+
+	// equalises the level and reads back only the preview
+	enqueueEqualise(dev_level_input, dev_level_output, lutBuffer, levelCount, bins, binDiv, bitsBuffer, true, queue);
+	std::vector<unsigned int> levelData(levelCount);
+	queue.enqueueReadBuffer(dev_level_output, CL_TRUE, 0, levelCount * sizeof(unsigned int), levelData.data());
+
+	// the level is shown with its own copy of the chroma planes
+	CImg<unsigned short> preview = image.get_resize(levelWidth, levelHeight, 1, image.spectrum(), 2);
+	std::copy(levelData.begin(), levelData.end(), preview.begin());
+	if (colour) {
+		preview = preview.YCbCrtoRGB();
+	}
+	CImgDisplay disp_preview(preview, "preview");
+	auto previewStop = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("preview", start, previewStop);
+	std::cout << "Preview at 1/" << factor << " scale shown after " << std::chrono::duration_cast<std::chrono::nanoseconds>(previewStop - start).count() << " NS" << endl;
+
+	// the full pass only needs the histogram again when the look up table is refined
+	enqueueEqualise(dev_image_input, dev_image_output, lutBuffer, (unsigned int)count, bins, binDiv, bitsBuffer, refine, queue);
+	std::vector<unsigned int> output(count);
+	queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, count * sizeof(unsigned int), output.data());
+	pool.Release(dev_image_input);
+	pool.Release(dev_image_output);
+	pool.Release(dev_level_input);
+	pool.Release(dev_level_output);
+	pool.Release(lutBuffer);
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+	pool.Release(dimsBuffer);
+	std::copy(output.begin(), output.end(), image.begin());
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	CImgDisplay disp_output(image, "output");
+	auto stop = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("full resolution", previewStop, stop);
+	std::cout << "Full resolution " << (refine ? "with a refined" : "reusing the preview") << " look up table shown after " << std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() << " NS" << endl;
+
+	while (!disp_preview.is_closed() && !disp_output.is_closed() && !disp_preview.is_keyESC() && !disp_output.is_keyESC()) {
+		disp_preview.wait(1);
+		disp_output.wait(1);
+	}
+}
+
+// equalises a rectangle of an image, moving only the rectangle between host and device
+// with wholeImage the look up table built from the rectangle is applied to every pixel instead
+void roiEqualise(string image_filename, unsigned int bits, unsigned int bins, unsigned int roi[4], bool wholeImage, cl::CommandQueue queue) {
+
+	// only the intensity of colour images is equalised
+	CImg<unsigned short> image(image_filename.c_str());
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+	unsigned int width = image.width();
+	unsigned int height = image.height() * image.depth();
+	size_t count = (size_t)width * height;
+	// compared against the space left after the corner so a huge width or height can not wrap the sum
+	if (roi[2] == 0 || roi[3] == 0 || roi[0] >= width || roi[2] > width - roi[0] || roi[1] >= height || roi[3] > height - roi[1]) {
+		std::cerr << "Region " << roi[0] << "," << roi[1] << "," << roi[2] << "," << roi[3] << " is empty or outside the " << width << "x" << height << " image" << endl;
+		return;
+	}
+	std::vector<unsigned int> pixels(image.begin(), image.begin() + count);
+	for (size_t i = 0; i < pixels.size(); i++) {
+		pixels[i] = min(pixels[i], bits - 1);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	unsigned int binsDivider = bits / bins;
+	unsigned int rect[3] = { roi[0], roi[1], width };
+	cl::Buffer dev_image_input = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer dev_image_output = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer lutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer rectBuffer = pool.Acquire(sizeof(rect));
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+	queue.enqueueWriteBuffer(rectBuffer, CL_TRUE, 0, sizeof(rect), rect);
+
+	// the rectangle keeps its place in the device copy so the kernels index both with the image's row pitch
+	cl::array<cl::size_type, 3> origin = { { roi[0] * sizeof(unsigned int), roi[1], 0 } };
+	cl::array<cl::size_type, 3> region = { { roi[2] * sizeof(unsigned int), roi[3], 1 } };
+	size_t pitch = width * sizeof(unsigned int);
+	cl::Event InEvent;
+	if (wholeImage) {
+		queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, count * sizeof(unsigned int), pixels.data(), NULL, &InEvent);
+	}
+	else {
+		queue.enqueueWriteBufferRect(dev_image_input, CL_FALSE, origin, origin, region, pitch, 0, pitch, 0, pixels.data(), NULL, &InEvent);
+	}
+
+	// histogram of the rectangle only
+	cl::Event HistEvent;
+	queue.enqueueFillBuffer(lutBuffer, 0u, 0, bins * sizeof(unsigned int));
+	RegisteredKernel& histogram_Kernel = registry["histogram_rect"];
+	histogram_Kernel.Bind(0, dev_image_input);
+	histogram_Kernel.Bind(1, lutBuffer);
+	histogram_Kernel.Bind(2, binDiv);
+	histogram_Kernel.Bind(3, rectBuffer);
+	queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(roi[2], roi[3]), cl::NullRange, NULL, &HistEvent);
+
+	// the histogram becomes the look up table in place
+	segmentedLUT(lutBuffer, cl::Buffer(), 1, bins, bitsBuffer, queue);
+
+	cl::Event EqEvent;
+	cl::Event OutEvent;
+	if (wholeImage) {
+		RegisteredKernel& Equalise = registry["equalise"];
+		Equalise.Bind(0, dev_image_input);
+		Equalise.Bind(1, dev_image_output);
+		Equalise.Bind(2, lutBuffer);
+		Equalise.Bind(3, binDiv);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(count), cl::NullRange, NULL, &EqEvent);
+		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, count * sizeof(unsigned int), pixels.data(), NULL, &OutEvent);
+	}
+	else {
+
+		// only the rectangle is equalised and read back over the host copy, the rest of the image keeps its values
+		RegisteredKernel& Equalise = registry["equalise_rect"];
+		Equalise.Bind(0, dev_image_input);
+		Equalise.Bind(1, dev_image_output);
+		Equalise.Bind(2, lutBuffer);
+		Equalise.Bind(3, binDiv);
+		Equalise.Bind(4, rectBuffer);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(roi[2], roi[3]), cl::NullRange, NULL, &EqEvent);
+		queue.enqueueReadBufferRect(dev_image_output, CL_TRUE, origin, origin, region, pitch, 0, pitch, 0, pixels.data(), NULL, &OutEvent);
+	}
+	pool.Release(dev_image_input);
+	pool.Release(dev_image_output);
+	pool.Release(lutBuffer);
+	pool.Release(binDiv);
+	pool.Release(bitsBuffer);
+	pool.Release(rectBuffer);
+	auto stop = std::chrono::high_resolution_clock::now();
+
+	trace.AddEvent("region write", InEvent);
+	trace.AddEvent("histogram_rect", HistEvent);
+	trace.AddEvent(wholeImage ? "equalise" : "equalise_rect", EqEvent);
+	trace.AddEvent("region read", OutEvent);
+	std::cout << "Region " << roi[2] << "x" << roi[3] << " at " << roi[0] << "," << roi[1] << " of " << width << "x" << height << " equalised in " << std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() << " NS" << endl;
+	std::cout << "Input transfer time [ns]:" << eventTime(InEvent) << ", output transfer time [ns]:" << eventTime(OutEvent) << endl;
+
+	std::copy(pixels.begin(), pixels.end(), image.begin());
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	if (bits == 65536) {
+		image.save(colour ? "Equalised.ppm" : "Equalised.pgm");
+	}
+	else {
+		CImg<unsigned char>(image).save(colour ? "Equalised.ppm" : "Equalised.pgm");
+	}
+}
+
+// equalises an image through the library with no prompts or display, for scripted use
+void headlessEqualise(string input, string output, unsigned int bits, unsigned int bins, cl::Context context, cl::Device device) {
+	Equaliser equaliser(context, device);
+
+	// only the intensity of colour images is equalised
+	CImg<unsigned short> image(input.c_str());
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+	size_t count = (size_t)image.width() * image.height() * image.depth();
+
+	// keeps the values inside the chosen bit depth
+	std::vector<unsigned int> pixels(image.begin(), image.begin() + count);
+	for (int i = 0; i < pixels.size(); i++) {
+		pixels[i] = min(pixels[i], bits - 1);
+	}
+
+	std::vector<unsigned int> equalised(count);
+	equaliser.equalise(pixels.data(), count, bits, bins, equalised.data());
+	std::copy(equalised.begin(), equalised.end(), image.begin());
+
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	if (bits == 65536) {
+		image.save(output.c_str());
+	}
+	else {
+		CImg<unsigned char>(image).save(output.c_str());
+	}
+	std::cout << "Equalised " << input << " to " << output << endl;
+}
+
+// a named shared memory segment that a client and the daemon both map, so images are passed without copies
+struct SharedSegment {
+	unsigned char* data = NULL;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE mapping = NULL;
+#else
+	int file = -1;
+#endif
+};
+
+// creates a new segment when create is set, otherwise opens one the client made
+// an opened segment must be at least size bytes, so a short segment is refused rather than faulting when it is read
+bool mapShared(string name, size_t size, bool create, SharedSegment& segment) {
+	segment.size = size;
+#ifdef _WIN32
+	if (create) {
+		segment.mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, name.c_str());
+	}
+	else {
+		segment.mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+	}
+	if (segment.mapping == NULL) {
+		return false;
+	}
+	// mapping more than the segment holds fails here
+	segment.data = (unsigned char*)MapViewOfFile(segment.mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+	segment.file = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+	if (segment.file < 0) {
+		return false;
+	}
+	if (create && ftruncate(segment.file, size) != 0) {
+		return false;
+	}
+	struct stat info;
+	if (!create && (fstat(segment.file, &info) != 0 || (size_t)info.st_size < size)) {
+		return false;
+	}
+	void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.file, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	segment.data = (unsigned char*)data;
+#endif
+	return segment.data != NULL;
+}
+
+// releases a shared segment, the creator also removes its name
+void unmapShared(string name, bool created, SharedSegment& segment) {
+#ifdef _WIN32
+	if (segment.data != NULL) UnmapViewOfFile(segment.data);
+	if (segment.mapping != NULL) CloseHandle(segment.mapping);
+#else
+	if (segment.data != NULL) munmap(segment.data, segment.size);
+	if (segment.file >= 0) close(segment.file);
+	if (created) shm_unlink(name.c_str());
+#endif
+	segment = SharedSegment();
+}
+
+// a job connection to the equalisation daemon
+#ifdef _WIN32
+typedef SOCKET socket_t;
+void closeSocket(socket_t s) { closesocket(s); }
+#else
+typedef int socket_t;
+const socket_t INVALID_SOCKET = -1;
+void closeSocket(socket_t s) { close(s); }
+#endif
+
+// fills in the address of a unix domain socket
+bool socketAddress(string path, sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cout << "Socket path is too long: " << path << endl;
+		return false;
+	}
+	strcpy(address.sun_path, path.c_str());
+	return true;
+}
+
+// reads one newline terminated line, returns false when the other end has closed
+bool readLine(socket_t s, string& line) {
+	line.clear();
+	char c;
+	while (recv(s, &c, 1, 0) == 1) {
+		if (c == '\n') {
+			return true;
+		}
+		line += c;
+	}
+	return false;
+}
+
+void sendLine(socket_t s, string line) {
+	line += '\n';
+	size_t sent = 0;
+	while (sent < line.size()) {
+		int result = send(s, line.data() + sent, (int)(line.size() - sent), 0);
+		if (result <= 0) {
+			return;
+		}
+		sent += result;
+	}
+}
+
+// splits a job line on tabs, so paths may contain spaces
+std::vector<string> jobFields(const string& line) {
+	std::vector<string> fields;
+	stringstream stream(line);
+	string field;
+	while (getline(stream, field, '\t')) {
+		fields.push_back(field);
+	}
+	return fields;
+}
+
+// plans kept warm between jobs, keyed by everything that fixes their buffers
+typedef std::tuple<unsigned int, unsigned int, unsigned int, unsigned int, unsigned int> PlanKey;
+typedef std::map<PlanKey, std::unique_ptr<EqualisationPlan>> PlanCache;
+
+// finds the plan for an image shape, building it the first time the shape is seen
+EqualisationPlan& cachedPlan(PlanCache& plans, unsigned int width, unsigned int height, unsigned int channels, unsigned int bitDepth, unsigned int bins, TuningDatabase* tuning, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+	std::unique_ptr<EqualisationPlan>& plan = plans[PlanKey(width, height, channels, bitDepth, bins)];
+	if (!plan) {
+		plan.reset(new EqualisationPlan(context, device, queue, program, width, height, channels, bitDepth, bins, tuning));
 	}
+	return *plan;
+}
 
-	cl::Event pixelTransfer;
-	cl::Event sumsTransfer;
-	cl::Event sumEvent;
-	cl::Event outputTansfer;
+// equalises one loaded image through a cached plan, in place
+template <typename T>
+void serveImage(CImg<T>& image, unsigned int bitDepth, unsigned int bins, PlanCache& plans, TuningDatabase* tuning, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
 
+	// only the intensity of colour images is equalised
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
 
-	// creates buffer for pixels and local sums and write buffers to memeory
-	cl::Buffer pixelsBuffer(context, CL_MEM_READ_ONLY, pixels.size() * sizeof(unsigned int));
-	cl::Buffer sumsBuffer(context, CL_MEM_READ_ONLY, sums.size() * sizeof(unsigned int));
-	queue.enqueueWriteBuffer(pixelsBuffer, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), &pixels[0], NULL, &pixelTransfer);
-	queue.enqueueWriteBuffer(sumsBuffer, CL_TRUE, 0, sums.size() * sizeof(unsigned int), &sums[0], NULL, &sumsTransfer);
+	cachedPlan(plans, image.width(), image.height() * image.depth(), image.spectrum(), bitDepth, bins, tuning, context, queue, program, device).execute(image.data(), image.data());
 
-	// creates and sets arugments for kernel which calculates cumulative sum
-	cl::Kernel sum_Kernel(program, "local_Sum");
-	sum_Kernel.setArg(0, pixelsBuffer);
-	sum_Kernel.setArg(1, sumsBuffer);
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+}
 
-	// runs kernel with an offset to above adding the wrong sum to each group
-	queue.enqueueNDRangeKernel(sum_Kernel, cl::NDRange(LocalSize), cl::NDRange(pixels.size()), cl::NDRange(LocalSize), NULL, &sumEvent);
-	// reads output histogram from the buffer
-	queue.enqueueReadBuffer(pixelsBuffer, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), pixels.data(), NULL, &outputTansfer);
+// runs one job line and returns the reply line
+string serveJob(const string& line, PlanCache& plans, TuningDatabase* tuning, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+	std::vector<string> fields = jobFields(line);
+
+	// file <input> <output> <bit depth> <bins>
+	if (fields.size() == 5 && fields[0] == "file") {
+		unsigned int bitDepth = (atoi(fields[3].c_str()) == 16) ? 16 : 8;
+		unsigned int bins = atoi(fields[4].c_str());
+		unsigned int levels = (bitDepth == 16) ? 65536 : 256;
+		if (bins == 0 || levels % bins != 0) {
+			return "error\tbins must divide the bit depth";
+		}
 
-	// outputs runtime
-	std::cout << GetFullProfilingInfo(sumEvent, ProfilingResolution::PROF_NS) << std::endl;
-	std::cout << "Image transfer time [ns]:" << pixelTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - pixelTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-	std::cout << "binsize transfer time [ns]:" << sumsTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - sumsTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-	std::cout << "Output transfer time [ns]:" << outputTansfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputTansfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-	
+		auto start = std::chrono::high_resolution_clock::now();
+		if (bitDepth == 16) {
+			CImg<unsigned short> image(fields[1].c_str());
+			serveImage(image, bitDepth, bins, plans, tuning, context, queue, program, device);
+			image.save(fields[2].c_str());
+		}
+		else {
+			CImg<unsigned char> image(fields[1].c_str());
+			serveImage(image, bitDepth, bins, plans, tuning, context, queue, program, device);
+			image.save(fields[2].c_str());
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		trace.AddSpan("job", start, stop);
+		return "ok\t" + std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+	}
 
-	// returns cumulative histogram back to main program
-	return pixels;
+	// shm <segment> <width> <height> <channels> <bit depth> <bins>
+	// the segment holds planar pixels with the intensity first and is equalised in place
+	if (fields.size() == 7 && fields[0] == "shm") {
+		unsigned int width = atoi(fields[2].c_str());
+		unsigned int height = atoi(fields[3].c_str());
+		unsigned int channels = atoi(fields[4].c_str());
+		unsigned int bitDepth = (atoi(fields[5].c_str()) == 16) ? 16 : 8;
+		unsigned int bins = atoi(fields[6].c_str());
+		unsigned int levels = (bitDepth == 16) ? 65536 : 256;
+		if (bins == 0 || levels % bins != 0) {
+			return "error\tbins must divide the bit depth";
+		}
+		if (width == 0 || height == 0 || channels == 0) {
+			return "error\tempty image";
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		size_t planeBytes = (size_t)width * height * (bitDepth / 8);
+		SharedSegment segment;
+		if (!mapShared(fields[1], planeBytes * channels, false, segment)) {
+			unmapShared(fields[1], false, segment);
+			return "error\tcould not map " + fields[1] + " or it is smaller than the image";
+		}
+
+		// the device reads and writes the mapped pages directly, the buffer is released before the pages are unmapped
+		try {
+			cl::Buffer dev_image_shared(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, planeBytes, segment.data);
+			cachedPlan(plans, width, height, channels, bitDepth, bins, tuning, context, queue, program, device).execute(dev_image_shared);
+		}
+		catch (...) {
+
+			// waits for anything still using the pages before they go
+			queue.finish();
+			unmapShared(fields[1], false, segment);
+			throw;
+		}
+		unmapShared(fields[1], false, segment);
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		trace.AddSpan("shared job", start, stop);
+		return "ok\t" + std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+	}
+
+	return "error\tunknown job: " + line;
+}
+
+// keeps the context, program and plans warm and equalises jobs sent over a unix domain socket
+// one job per line, each answered with "ok <ns>" or "error <message>", "shutdown" stops the server
+void serveJobs(string socketPath, TuningDatabase* tuning, cl::Context context, cl::CommandQueue queue, cl::Program program, cl::Device device) {
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+	sockaddr_un address;
+	if (!socketAddress(socketPath, address)) {
+		return;
+	}
+
+	// removes a socket left behind by an earlier server
+	remove(socketPath.c_str());
+
+#ifndef _WIN32
+	// a client that hangs up before its reply would otherwise kill the server on the next send
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	socket_t server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server == INVALID_SOCKET || bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, 8) != 0) {
+		std::cout << "Could not listen on " << socketPath << endl;
+		if (server != INVALID_SOCKET) {
+			closeSocket(server);
+		}
+		return;
+	}
+	std::cout << "Serving equalisation jobs on " << socketPath << endl;
+
+	PlanCache plans;
+	bool running = true;
+	int jobs = 0;
+	int failedAccepts = 0;
+	while (running) {
+		socket_t client = accept(server, NULL, NULL);
+		if (client == INVALID_SOCKET) {
+
+			// accept keeps failing while the process is out of descriptors, so it waits instead of spinning and stops if it never clears
+			if (++failedAccepts == 50) {
+				std::cout << "Accept keeps failing, stopping the server" << endl;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+		failedAccepts = 0;
+
+		// a client may send any number of jobs before closing
+		string line;
+		while (running && readLine(client, line)) {
+			if (line == "shutdown") {
+				running = false;
+				sendLine(client, "ok\t0");
+				break;
+			}
+
+			string reply;
+			try {
+				reply = serveJob(line, plans, tuning, context, queue, program, device);
+			}
+			catch (const cl::Error& err) {
+				reply = "error\t" + string(err.what()) + ", " + getErrorString(err.err());
+			}
+			catch (const CImgException& err) {
+				reply = string("error\t") + err.what();
+			}
+			sendLine(client, reply);
+			jobs++;
+		}
+		closeSocket(client);
+	}
+
+	closeSocket(server);
+	remove(socketPath.c_str());
+	std::cout << "Served " << jobs << " jobs with " << plans.size() << " plans" << endl;
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
 }
 
+// bundled client, sends the same job to a running server a number of times and reports the round trip latency
+int submitJobs(string socketPath, std::vector<string> job, int repeats) {
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
 
-int gcd(int a, int b)
-{
+	sockaddr_un address;
+	if (!socketAddress(socketPath, address)) {
+		return 1;
+	}
+
+	socket_t server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server == INVALID_SOCKET || connect(server, (sockaddr*)&address, sizeof(address)) != 0) {
+		std::cout << "Could not connect to " << socketPath << endl;
+		if (server != INVALID_SOCKET) {
+			closeSocket(server);
+		}
+		return 1;
+	}
 
-/***************************************************************************************
-*    Title: Program to Find GCD or HCF of Two Numbers
-*    Author: GeeksforGeeks
-*    Date: 14 Mar, 2023
-*    Code version: N/A
-*    Availability: https://www.geeksforgeeks.org/program-to-find-gcd-or-hcf-of-two-numbers/
-*
-***************************************************************************************/
+	string line;
+	for (int i = 0; i < job.size(); i++) {
+		line += (i == 0 ? "" : "\t") + job[i];
+	}
 
-	int result = min(a, b); // Find Minimum of a and b
-	while (result > 0) {
-		if (a % result == 0 && b % result == 0) {
+	int failures = 0;
+	std::vector<double> latencies;
+	for (int i = 0; i < repeats; i++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		sendLine(server, line);
+		string reply;
+		if (!readLine(server, reply)) {
+			std::cout << "Server closed the connection" << endl;
+			failures++;
 			break;
 		}
-		result--;
+		auto stop = std::chrono::high_resolution_clock::now();
+
+		if (reply.compare(0, 3, "ok\t") != 0) {
+			std::cout << reply << endl;
+			failures++;
+		}
+		latencies.push_back((double)std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+	}
+	closeSocket(server);
+
+	if (!latencies.empty()) {
+		TimingStats stats = timingStats(latencies);
+		std::cout << latencies.size() << " jobs, round trip median " << stats.median << " NS, p95 " << stats.p95 << " NS, min " << stats.min << " NS" << endl;
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return failures == 0 ? 0 : 1;
+}
+
+// places an image in a shared segment, has the server equalise it there and saves the result
+template <typename T>
+int submitShared(string socketPath, CImg<T> image, unsigned int bitDepth, unsigned int bins, string output, int repeats) {
+
+	// the server equalises the first plane, so colour images go over as YCbCr
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+
+#ifdef _WIN32
+	string name = "Local\\equalise_" + std::to_string(GetCurrentProcessId());
+#else
+	string name = "/equalise_" + std::to_string(getpid());
+#endif
+	SharedSegment segment;
+	if (!mapShared(name, image.size() * sizeof(T), true, segment)) {
+		std::cout << "Could not create shared memory " << name << endl;
+		unmapShared(name, true, segment);
+		return 1;
+	}
+	memcpy(segment.data, image.data(), image.size() * sizeof(T));
+
+	int result = submitJobs(socketPath, { "shm", name, std::to_string(image.width()), std::to_string(image.height() * image.depth()), std::to_string(image.spectrum()), std::to_string(bitDepth), std::to_string(bins) }, repeats);
+
+	memcpy(image.data(), segment.data, image.size() * sizeof(T));
+	unmapShared(name, true, segment);
+
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	image.save(output.c_str());
+	return result;
+}
+
+// rates measured by earlier co-execution runs, in pixels per nanosecond per host thread and for the device
+struct CoRates {
+	double host = 0;
+	double device = 0;
+};
+
+CoRates loadCoRates(string filename, string deviceName) {
+	CoRates rates;
+	ifstream file(filename);
+	string line;
+	while (getline(file, line)) {
+		std::vector<string> fields = jobFields(line);
+		if (fields.size() == 3 && fields[0] == deviceName) {
+			rates.host = atof(fields[1].c_str());
+			rates.device = atof(fields[2].c_str());
+		}
+	}
+	return rates;
+}
+
+void saveCoRates(string filename, string deviceName, CoRates rates) {
+	std::vector<string> lines;
+	ifstream file(filename);
+	string line;
+	while (getline(file, line)) {
+		if (line.compare(0, deviceName.size() + 1, deviceName + "\t") != 0) {
+			lines.push_back(line);
+		}
+	}
+	file.close();
+	ofstream out(filename);
+	for (int i = 0; i < lines.size(); i++) {
+		out << lines[i] << endl;
+	}
+	out << deviceName << "\t" << rates.host << "\t" << rates.device << endl;
+}
+
+// equalises with the host threads and the device working at the same time on chunks taken from a shared counter
+// the device takes several chunks per grab, sized from the rates of earlier runs, so its launches are not dwarfed by overhead
+void coEqualise(string image_filename, unsigned int bits, unsigned int bins, cl::CommandQueue queue, cl::Device device) {
+
+	// only the intensity of colour images is equalised
+	CImg<unsigned short> image(image_filename.c_str());
+	bool colour = image.spectrum() == 3;
+	if (colour) {
+		image = image.RGBtoYCbCr();
+	}
+	size_t count = (size_t)image.width() * image.height() * image.depth();
+	std::vector<unsigned int> pixels(image.begin(), image.begin() + count);
+	for (int i = 0; i < pixels.size(); i++) {
+		pixels[i] = min(pixels[i], bits - 1);
+	}
+	std::vector<unsigned int> output(count);
+	unsigned int binsDivider = bits / bins;
+
+	// one thread drives the device, the rest run the host path
+	int hostThreads = max(1, (int)std::thread::hardware_concurrency() - 1);
+	string deviceName = device.getInfo<CL_DEVICE_NAME>();
+	CoRates rates = loadCoRates("CoExecution.db", deviceName);
+	size_t chunk = 64 * 1024;
+	size_t chunks = (count + chunk - 1) / chunk;
+	size_t deviceGrab = 1;
+	if (rates.host > 0 && rates.device > 0) {
+		deviceGrab = max((size_t)1, min(chunks / 2 + 1, (size_t)(rates.device / rates.host)));
+	}
+	std::cout << "Co-executing on " << hostThreads << " host threads and " << deviceName << ", device takes " << deviceGrab << " chunks per grab" << endl;
+
+	// chunk end offsets, kept alive for the non blocking writes of each launch's count
+	std::vector<unsigned int> chunkEnds(chunks);
+	for (size_t c = 0; c < chunks; c++) {
+		chunkEnds[c] = (unsigned int)min(count, (c + 1) * chunk);
+	}
+
+	cl::Buffer dev_image_input = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer dev_image_output = pool.Acquire(count * sizeof(unsigned int));
+	cl::Buffer histogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer lutBuffer = pool.Acquire(bins * sizeof(unsigned int));
+	cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
+	cl::Buffer countBuffer = pool.Acquire(sizeof(unsigned int));
+	queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+	queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+	RegisteredKernel& histogram_Kernel = registry["histogram_coarse"];
+	RegisteredKernel& Equalise = registry["equalise_coarse"];
+	size_t LocalSize = min((size_t)256, histogram_Kernel.workGroupSize);
+
+	// chunks already uploaded by the histogram pass do not need uploading again to equalise
+	std::vector<char> resident(chunks, 0);
+	std::atomic<size_t> next(0);
+	std::vector<double> hostBusy(hostThreads, 0);
+	double deviceBusy = 0;
+	size_t devicePixels = 0;
+
+	// runs one pass with every backend pulling from the shared counter until the chunks run out
+	// deviceChunks returns the event of the last command it enqueued for its grab
+	auto runPass = [&](std::function<void(size_t, size_t)> hostChunk, std::function<cl::Event(size_t, size_t)> deviceChunks) {
+		next = 0;
+		std::vector<std::thread> workers;
+		for (int t = 0; t < hostThreads; t++) {
+			workers.push_back(std::thread([&, t]() {
+				auto start = std::chrono::high_resolution_clock::now();
+				for (size_t c = next++; c < chunks; c = next++) {
+					hostChunk(c, t);
+				}
+				hostBusy[t] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+			}));
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+
+		// enqueues return straight away, so the device waits for the grab before last to finish before it takes more chunks
+		// otherwise it would claim most of the image before its first kernel had run, at most two grabs are queued
+		cl::Event inFlight[2];
+		for (size_t grab = 0; ; grab++) {
+			cl::Event& slot = inFlight[grab % 2];
+			if (slot()) {
+				slot.wait();
+			}
+			size_t c = next.fetch_add(deviceGrab);
+			if (c >= chunks) {
+				break;
+			}
+			slot = deviceChunks(c, min(chunks, c + deviceGrab));
+			queue.flush();
+		}
+		queue.finish();
+		deviceBusy += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		for (int t = 0; t < hostThreads; t++) {
+			workers[t].join();
+		}
+	};
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// histogram pass, each host thread counts into its own histogram
+	std::vector<std::vector<unsigned int>> hostHistograms(hostThreads, std::vector<unsigned int>(bins, 0));
+	runPass([&](size_t c, size_t t) {
+		std::vector<unsigned int>& histogram = hostHistograms[t];
+		for (size_t i = c * chunk; i < chunkEnds[c]; i++) {
+			unsigned int location = pixels[i] / binsDivider;
+
+			// matches the kernels, which leave bin 0 empty
+			if (location != 0) {
+				histogram[location]++;
+			}
+		}
+	}, [&](size_t first, size_t last) {
+		size_t begin = first * chunk;
+		size_t end = chunkEnds[last - 1];
+		queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, begin * sizeof(unsigned int), (end - begin) * sizeof(unsigned int), &pixels[begin]);
+		queue.enqueueWriteBuffer(countBuffer, CL_FALSE, 0, sizeof(unsigned int), &chunkEnds[last - 1]);
+
+		// the global offset starts the kernel's strided loop at the chunk and the count stops it at the chunk end
+		histogram_Kernel.Bind(0, dev_image_input);
+		histogram_Kernel.Bind(1, histogramBuffer);
+		histogram_Kernel.Bind(2, binDiv);
+		histogram_Kernel.Bind(3, countBuffer);
+		cl::Event HistEvent;
+		queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NDRange(begin), cl::NDRange(((end - begin + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize), NULL, &HistEvent);
+		for (size_t c = first; c < last; c++) {
+			resident[c] = 1;
+		}
+		devicePixels += end - begin;
+		return HistEvent;
+	});
+
+	// merges every histogram
+	std::vector<unsigned int> histogramData(bins);
+	queue.enqueueReadBuffer(histogramBuffer, CL_TRUE, 0, bins * sizeof(unsigned int), histogramData.data());
+	for (int t = 0; t < hostThreads; t++) {
+		for (int b = 0; b < bins; b++) {
+			histogramData[b] += hostHistograms[t][b];
+		}
+	}
+
+	// the look up table is only bins long so it is built on the host between the passes
+	// scaled down by 10 with bin 0 left empty, the same as the normalise kernel
+	std::vector<unsigned int> lutData(bins, 0);
+	// the minimum is the first non zero cumulative count scaled down, as cdf_bounds finds it, so no entry falls below it
+	unsigned int total = 0;
+	unsigned int firstTotal = 0;
+	for (int b = 0; b < bins; b++) {
+		total += histogramData[b];
+		lutData[b] = total;
+		if (firstTotal == 0) {
+			firstTotal = total;
+		}
+	}
+	unsigned int cdfMin = firstTotal / 10;
+	unsigned int cdfMax = total / 10;
+	for (int b = 0; b < bins; b++) {
+		lutData[b] = (b == 0 || lutData[b] == 0 || cdfMax == cdfMin) ? 0 : (unsigned int)((double)(lutData[b] / 10 - cdfMin) / (cdfMax - cdfMin) * (bits - 1));
+	}
+	queue.enqueueWriteBuffer(lutBuffer, CL_TRUE, 0, bins * sizeof(unsigned int), lutData.data());
+
+	// equalise pass
+	runPass([&](size_t c, size_t) {
+		for (size_t i = c * chunk; i < chunkEnds[c]; i++) {
+			output[i] = lutData[pixels[i] / binsDivider];
+		}
+	}, [&](size_t first, size_t last) {
+		for (size_t c = first; c < last; c++) {
+			if (!resident[c]) {
+				queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, c * chunk * sizeof(unsigned int), (chunkEnds[c] - c * chunk) * sizeof(unsigned int), &pixels[c * chunk]);
+			}
+		}
+		size_t begin = first * chunk;
+		size_t end = chunkEnds[last - 1];
+		queue.enqueueWriteBuffer(countBuffer, CL_FALSE, 0, sizeof(unsigned int), &chunkEnds[last - 1]);
+		Equalise.Bind(0, dev_image_input);
+		Equalise.Bind(1, dev_image_output);
+		Equalise.Bind(2, lutBuffer);
+		Equalise.Bind(3, binDiv);
+		Equalise.Bind(4, countBuffer);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NDRange(begin), cl::NDRange(((end - begin + LocalSize - 1) / LocalSize) * LocalSize), cl::NDRange(LocalSize));
+		cl::Event EqOutEvent;
+		queue.enqueueReadBuffer(dev_image_output, CL_FALSE, begin * sizeof(unsigned int), (end - begin) * sizeof(unsigned int), &output[begin], NULL, &EqOutEvent);
+		devicePixels += end - begin;
+		return EqOutEvent;
+	});
+
+	pool.Release(dev_image_input);
+	pool.Release(dev_image_output);
+	pool.Release(histogramBuffer);
+	pool.Release(lutBuffer);
+	pool.Release(binDiv);
+	pool.Release(countBuffer);
+	auto stop = std::chrono::high_resolution_clock::now();
+	trace.AddSpan("co-execution", start, stop);
+
+	// updates the stored rates so the next run sizes the device's grabs from this one
+	double hostTime = 0;
+	for (int t = 0; t < hostThreads; t++) {
+		hostTime += hostBusy[t];
+	}
+	size_t hostPixels = 2 * count - devicePixels;
+	CoRates measured;
+	measured.host = hostPixels / max(1.0, hostTime);
+	measured.device = devicePixels / max(1.0, deviceBusy);
+	if (rates.host > 0 && rates.device > 0) {
+		measured.host = 0.5 * (measured.host + rates.host);
+		measured.device = 0.5 * (measured.device + rates.device);
+	}
+	saveCoRates("CoExecution.db", deviceName, measured);
+
+	std::cout << "Device processed " << 50.0 * devicePixels / count << "% of the pixels, co-execution took " << std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() << " NS" << endl;
+
+	std::copy(output.begin(), output.end(), image.begin());
+	if (colour) {
+		image = image.YCbCrtoRGB();
+	}
+	if (bits == 65536) {
+		image.save(colour ? "Equalised.ppm" : "Equalised.pgm");
+	}
+	else {
+		CImg<unsigned char>(image).save(colour ? "Equalised.ppm" : "Equalised.pgm");
 	}
-	return result; // return gcd of a and b
 }
 
+// largest power of two no bigger than n
+size_t powerOfTwoBelow(size_t n) {
+	size_t result = 1;
+	while (result * 2 <= n) result *= 2;
+	return result;
+}
 
+// times every method each interactive stage can use so the cost model can choose between them
+// each run mirrors what main does for that method, transfers included, on random data of the requested size
+void calibrateCostModel(CostModel& costs, unsigned int bits, unsigned int bins, cl::Context context, cl::CommandQueue queue, cl::Program program) {
+	std::mt19937 random(1);
+	unsigned int binsDivider = bits / bins;
+	size_t largeImage = 4 * 1024 * 1024;
+	size_t largeBins = 65536;
+	std::vector<unsigned int> data;
+	std::vector<unsigned int> result;
+	std::vector<unsigned int> lut(bins, 0);
+	unsigned int minNum = 1;
+	unsigned int maxNum = (unsigned int)largeImage;
+
+	cl::Buffer dataBuffer, outBuffer, binsBuffer, binDiv, minNumBuffer, maxNumBuffer, bitsBuffer;
+
+	// the test data and buffers are only built once a variant actually has to be measured
+	// so a run with every cost already in the file allocates nothing
+	auto prepare = [&]() {
+		if (!data.empty()) {
+			return;
+		}
+		data.resize(largeImage);
+		for (int i = 0; i < data.size(); i++) {
+			data[i] = random() % bits;
+		}
+		result.resize(largeImage);
+
+		dataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, largeImage * sizeof(unsigned int));
+		outBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, largeImage * sizeof(unsigned int));
+		binsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, max((size_t)bins, largeBins) * sizeof(unsigned int));
+		binDiv = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		minNumBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		maxNumBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		bitsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, largeImage * sizeof(unsigned int), data.data());
+		queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider);
+		queue.enqueueWriteBuffer(minNumBuffer, CL_TRUE, 0, sizeof(unsigned int), &minNum);
+		queue.enqueueWriteBuffer(maxNumBuffer, CL_TRUE, 0, sizeof(unsigned int), &maxNum);
+		queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
+	};
+
+	// the image is already on the device before the histogram stage, so only the histogram comes back
+	costs.Calibrate("histogram", "S", 65536, largeImage, [&](size_t n) {
+		prepare();
+		std::vector<unsigned int> histogram(bins, 0);
+		for (size_t i = 0; i < n; i++) {
+			histogram[data[i] / binsDivider]++;
+		}
+	});
+	costs.Calibrate("histogram", "P", 65536, largeImage, [&](size_t n) {
+		prepare();
+		RegisteredKernel& histogram_Kernel = registry["histogram"];
+		queue.enqueueFillBuffer(binsBuffer, 0u, 0, bins * sizeof(unsigned int));
+		histogram_Kernel.Bind(0, dataBuffer);
+		histogram_Kernel.Bind(1, binsBuffer);
+		histogram_Kernel.Bind(2, binDiv);
+		queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(gcd(n, histogram_Kernel.workGroupSize)));
+		queue.enqueueReadBuffer(binsBuffer, CL_TRUE, 0, bins * sizeof(unsigned int), result.data());
+	});
+
+	// scans work on the histogram, the global scans only run as one work group
+	costs.Calibrate("scan", "S", 1024, largeBins, [&](size_t n) {
+		prepare();
+		std::vector<unsigned int> scan(data.begin(), data.begin() + n);
+		for (size_t i = 1; i < n; i++) {
+			scan[i] += scan[i - 1];
+		}
+	});
+	costs.Calibrate("scan", "H local", 1024, largeBins, [&](size_t n) {
+		prepare();
+		RegisteredKernel& Cumulative_kernel = registry["hs_local"];
+		int LocalSize = gcd(n, Cumulative_kernel.workGroupSize);
+		std::vector<unsigned int> scan(n);
+		std::vector<unsigned int> groupSums(n / LocalSize);
+		cl::Buffer sumsBuffer = pool.Acquire(groupSums.size() * sizeof(unsigned int));
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+		Cumulative_kernel.Bind(0, binsBuffer);
+		Cumulative_kernel.Bind(1, outBuffer);
+		Cumulative_kernel.Bind(2, sumsBuffer);
+		Cumulative_kernel.Set(3, cl::Local(LocalSize * sizeof(unsigned int)));
+		Cumulative_kernel.Set(4, cl::Local(LocalSize * sizeof(unsigned int)));
+		queue.enqueueNDRangeKernel(Cumulative_kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(LocalSize));
+		queue.enqueueReadBuffer(outBuffer, CL_TRUE, 0, n * sizeof(unsigned int), scan.data());
+		queue.enqueueReadBuffer(sumsBuffer, CL_TRUE, 0, groupSums.size() * sizeof(unsigned int), groupSums.data());
+		if (LocalSize != n) {
+			scan = localsum(scan, groupSums, LocalSize, queue);
+		}
+		pool.Release(sumsBuffer);
+	});
+	costs.Calibrate("scan", "B local", 1024, largeBins, [&](size_t n) {
+		prepare();
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+		deviceScan(binsBuffer, binsBuffer, (int)n, context, queue, program, context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+		queue.enqueueReadBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+	});
+	size_t globalLimit = powerOfTwoBelow(min(registry["hs"].workGroupSize, registry["blelloch"].workGroupSize));
+	if (globalLimit > 16) {
+		costs.Calibrate("scan", "H global", 16, globalLimit, [&](size_t n) {
+			prepare();
+			RegisteredKernel& Cumulative_Kernel = registry["hs"];
+			queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+			Cumulative_Kernel.Bind(0, binsBuffer);
+			Cumulative_Kernel.Bind(1, outBuffer);
+			queue.enqueueNDRangeKernel(Cumulative_Kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(n));
+			queue.enqueueReadBuffer(outBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+		});
+		costs.Calibrate("scan", "B global", 16, globalLimit, [&](size_t n) {
+			prepare();
+			RegisteredKernel& Cumulative_kernel = registry["blelloch"];
+			queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+			Cumulative_kernel.Bind(0, binsBuffer);
+			queue.enqueueNDRangeKernel(Cumulative_kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(n));
+			queue.enqueueReadBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+		});
+	}
 
+	// finding the minimum of the cumulative histogram
+	costs.Calibrate("min", "S", 1024, largeBins, [&](size_t n) {
+		prepare();
+		size_t i = 0;
+		while (i < n && data[i] == 0) i++;
+		minNum = (i < n) ? data[i] : 0;
+	});
+	costs.Calibrate("min", "P", 1024, largeBins, [&](size_t n) {
+		prepare();
+		RegisteredKernel& Reduce = registry["reduce"];
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+		Reduce.Bind(0, binsBuffer);
+		size_t LocalSize = gcd(n, Reduce.workGroupSize);
+		queue.enqueueNDRangeKernel(Reduce.kernel, cl::NullRange, cl::NDRange(LocalSize), cl::NDRange(LocalSize));
+		queue.enqueueReadBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+	});
+
+	// normalising the cumulative histogram
+	costs.Calibrate("normalise", "S", 1024, largeBins, [&](size_t n) {
+		prepare();
+		for (size_t i = 0; i < n; i++) {
+			double normalised = (double)((int)data[i] - (int)minNum) / (maxNum - minNum);
+			result[i] = (unsigned int)(normalised * (bits - 1));
+		}
+	});
+	costs.Calibrate("normalise", "P", 1024, largeBins, [&](size_t n) {
+		prepare();
+		RegisteredKernel& Normalise_kernel = registry["normalise"];
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), data.data());
+		Normalise_kernel.Bind(0, binsBuffer);
+		Normalise_kernel.Bind(1, minNumBuffer);
+		Normalise_kernel.Bind(2, maxNumBuffer);
+		Normalise_kernel.Bind(3, bitsBuffer);
+		queue.enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(n), cl::NullRange);
+		queue.enqueueReadBuffer(binsBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+	});
+
+	// mapping the image through the look up table, the parallel method also reads the image back
+	costs.Calibrate("equalise", "S", 65536, largeImage, [&](size_t n) {
+		prepare();
+		for (size_t i = 0; i < n; i++) {
+			result[i] = lut[data[i] / binsDivider];
+		}
+	});
+	costs.Calibrate("equalise", "P", 65536, largeImage, [&](size_t n) {
+		prepare();
+		RegisteredKernel& Equalise = registry["equalise"];
+		queue.enqueueWriteBuffer(binsBuffer, CL_TRUE, 0, bins * sizeof(unsigned int), lut.data());
+		Equalise.Bind(0, dataBuffer);
+		Equalise.Bind(1, outBuffer);
+		Equalise.Bind(2, binsBuffer);
+		Equalise.Bind(3, binDiv);
+		queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, cl::NDRange(n), cl::NDRange(gcd(n, Equalise.workGroupSize)));
+		queue.enqueueReadBuffer(outBuffer, CL_TRUE, 0, n * sizeof(unsigned int), result.data());
+	});
+}
 
 void print_help() {
 	std::cerr << "Application usage:" << std::endl;
@@ -86,6 +2821,35 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -b : image bit depth, 8 or 16 (default: ask)" << std::endl;
+	std::cerr << "  -n : number of bins (default: ask)" << std::endl;
+	std::cerr << "  -v : treat -f as a printf style frame pattern (e.g. frame_%03d.pgm) and equalise it as a video stream" << std::endl;
+	std::cerr << "  -m : treat -f as a text file listing images to equalise together as one packed batch" << std::endl;
+	std::cerr << "  -x : stream a binary pgm through tiles of this many megapixels, for images larger than device memory" << std::endl;
+	std::cerr << "  -w : use 64 bit histogram counts in tiled mode (automatic above 4294967295 pixels)" << std::endl;
+	std::cerr << "  -t : histogram distance before a stream rebuilds its look up table (default: 0.05)" << std::endl;
+	std::cerr << "  -a : smoothing applied when a stream rebuilds its look up table, 1 = replace (default: 1)" << std::endl;
+	std::cerr << "  -s : build the parallel and stream histograms from one in this many pixels (default: 1, every pixel)" << std::endl;
+	std::cerr << "  -e : largest error of a sampled cumulative histogram, as a fraction of the pixels, before sampling falls back to every pixel (default: 0.01)" << std::endl;
+	std::cerr << "  -P : show a preview of -f downsampled by this factor (2 or 4) before the full resolution pass" << std::endl;
+	std::cerr << "  -L : with -P, rebuild the look up table from every pixel instead of reusing the preview's" << std::endl;
+	std::cerr << "  -i : equalise only the region x,y,w,h of -f, transferring just that rectangle, saved to Equalised.pgm/ppm" << std::endl;
+	std::cerr << "  -W : with -i, apply the region's look up table to the whole image" << std::endl;
+	std::cerr << "  -g : number of CLAHE tiles across and down (default: 8)" << std::endl;
+	std::cerr << "  -k : CLAHE clip limit as a multiple of the average tile bin (default: 4)" << std::endl;
+	std::cerr << "  -B : benchmark every stage variant on the sample and synthetic images, written to Benchmark.csv and Benchmark.json" << std::endl;
+	std::cerr << "  -r : number of timed benchmark repetitions (default: 10)" << std::endl;
+	std::cerr << "  -R : build an equalisation plan once and execute it this many times on the image" << std::endl;
+	std::cerr << "  -u : use work group sizes and coarsening tuned per device and image size, kept in Tuning.db" << std::endl;
+	std::cerr << "  -T : write a Chrome trace of the run to this file" << std::endl;
+	std::cerr << "  -D : split -f into row bands across every device of the platform, sized by measured throughput" << std::endl;
+	std::cerr << "  -N : split the selected CPU device into one sub device per NUMA node and give each a band of -f" << std::endl;
+	std::cerr << "  -A : choose every stage's method from measured costs in CostModel.db instead of asking (CLAHE is only offered interactively)" << std::endl;
+	std::cerr << "  -c : equalise -f with the host threads and the device sharing the work, balanced from earlier runs in CoExecution.db" << std::endl;
+	std::cerr << "  -o : equalise -f to this file with no prompts or display" << std::endl;
+	std::cerr << "  -S : serve equalisation jobs on this unix domain socket, keeping the context and plans warm" << std::endl;
+	std::cerr << "  -M : with -C, pass the image to the server through shared memory instead of a file path" << std::endl;
+	std::cerr << "  -C : send -f to the server on this socket, written to -o, repeated -R times (paths are opened by the server)" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
@@ -98,6 +2862,35 @@ int main(int argc, char **argv) {
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename = "test.pgm";
+	unsigned int bitsArg = 0;
+	unsigned int binsArg = 0;
+	bool streamMode = false;
+	bool batchMode = false;
+	size_t tilePixels = 0;
+	bool wideCounts = false;
+	bool benchmarkMode = false;
+	bool autotune = false;
+	int planRepeats = 0;
+	string traceFile;
+	string outputFile;
+	string serveSocket;
+	string clientSocket;
+	bool sharedJob = false;
+	bool allDevices = false;
+	bool numaSplit = false;
+	bool coExecute = false;
+	bool autoSelect = false;
+	int reps = 10;
+	float threshold = 0.05f;
+	float alpha = 1.0f;
+	unsigned int sampleEvery = 1;
+	float tolerance = 0.01f;
+	unsigned int previewFactor = 0;
+	bool refinePreview = false;
+	unsigned int roi[4] = { 0, 0, 0, 0 };
+	bool roiWhole = false;
+	unsigned int tiles = 8;
+	float clipFactor = 4.0f;
 
 	// stores input argumets
 	for (int i = 1; i < argc; i++) {
@@ -105,14 +2898,103 @@ int main(int argc, char **argv) {
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { bitsArg = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { binsArg = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-v") == 0) { streamMode = true; }
+		else if (strcmp(argv[i], "-m") == 0) { batchMode = true; }
+		else if (strcmp(argv[i], "-w") == 0) { wideCounts = true; }
+		else if (strcmp(argv[i], "-B") == 0) { benchmarkMode = true; }
+		else if (strcmp(argv[i], "-u") == 0) { autotune = true; }
+		else if ((strcmp(argv[i], "-R") == 0) && (i < (argc - 1))) { planRepeats = max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-S") == 0) && (i < (argc - 1))) { serveSocket = argv[++i]; }
+		else if ((strcmp(argv[i], "-C") == 0) && (i < (argc - 1))) { clientSocket = argv[++i]; }
+		else if (strcmp(argv[i], "-M") == 0) { sharedJob = true; }
+		else if (strcmp(argv[i], "-D") == 0) { allDevices = true; }
+		else if (strcmp(argv[i], "-N") == 0) { numaSplit = true; }
+		else if (strcmp(argv[i], "-c") == 0) { coExecute = true; }
+		else if (strcmp(argv[i], "-A") == 0) { autoSelect = true; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { outputFile = argv[++i]; }
+		else if ((strcmp(argv[i], "-T") == 0) && (i < (argc - 1))) { traceFile = argv[++i]; }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reps = max(1, atoi(argv[++i])); }
+		else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { tilePixels = (size_t)(atof(argv[++i]) * 1000000); }
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { threshold = atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { sampleEvery = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { tolerance = atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-P") == 0) && (i < (argc - 1))) { previewFactor = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-L") == 0) { refinePreview = true; }
+		else if ((strcmp(argv[i], "-i") == 0) && (i < (argc - 1))) {
+			if (sscanf(argv[++i], "%u,%u,%u,%u", &roi[0], &roi[1], &roi[2], &roi[3]) != 4) {
+				std::cerr << "ERROR: -i takes a region as x,y,w,h" << std::endl;
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-W") == 0) { roiWhole = true; }
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { alpha = atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { tiles = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { clipFactor = atof(argv[++i]); }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
 	cimg::exception_mode(0);
 
+	// every CLAHE tile size is the image divided by the tile count
+	if (tiles == 0) {
+		std::cerr << "ERROR: -g needs at least one tile" << std::endl;
+		return 1;
+	}
+
+	// bit depth and bins for the modes that take them from the command line, checked once here for all of them
+	unsigned int modeBits = (bitsArg == 16) ? 65536 : 256;
+	unsigned int modeBins = (binsArg != 0) ? binsArg : modeBits;
+	if (!validBins(modeBits, modeBins)) {
+		std::cerr << "ERROR: " << modeBins << " bins does not divide the " << modeBits << " levels of the bit depth" << std::endl;
+		return 1;
+	}
+
+	// the downsample kernel sums a factor by factor block in a uint, which only stays in range for the small factors
+	if (previewFactor != 0 && previewFactor != 2 && previewFactor != 4) {
+		std::cerr << "ERROR: the preview factor must be 2 or 4" << std::endl;
+		return 1;
+	}
+
+	// the client only talks to a running server, so it needs no OpenCL setup of its own
+	if (!clientSocket.empty()) {
+		// keeps the input's extension, falling back to pgm when the file name has none
+		size_t dot = image_filename.find_last_of(".");
+		size_t slash = image_filename.find_last_of("/\\");
+		string extension = (dot == string::npos || (slash != string::npos && dot < slash)) ? ".pgm" : image_filename.substr(dot);
+		string clientOutput = outputFile.empty() ? "Equalised" + extension : outputFile;
+		string clientBits = (bitsArg == 16) ? "16" : "8";
+		string clientBins = std::to_string(modeBins);
+		if (sharedJob && bitsArg == 16) {
+			return submitShared(clientSocket, CImg<unsigned short>(image_filename.c_str()), 16, modeBins, clientOutput, max(1, planRepeats));
+		}
+		else if (sharedJob) {
+			return submitShared(clientSocket, CImg<unsigned char>(image_filename.c_str()), 8, modeBins, clientOutput, max(1, planRepeats));
+		}
+		return submitJobs(clientSocket, { "file", image_filename, clientOutput, clientBits, clientBins }, max(1, planRepeats));
+	}
+
 	//detect any potential exceptions
 	try {
 
+		// runs across one sub device per NUMA node of the selected device
+		if (numaSplit) {
+			cl::Device parent = GetContext(platform_id, device_id).getInfo<CL_CONTEXT_DEVICES>()[0];
+			std::vector<cl::Device> subDevices = numaSubDevices(parent);
+			std::cout << "Runing on " << GetDeviceName(platform_id, device_id) << " as " << subDevices.size() << " NUMA sub devices" << std::endl;
+			runMultiDevice(image_filename, modeBits, modeBins, cl::Context(subDevices), true, traceFile);
+			return 0;
+		}
+
+		// runs across every device of the platform instead of the one selected device
+		if (allDevices) {
+			cl::Context platformContext = GetPlatformContext(platform_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << platformContext.getInfo<CL_CONTEXT_DEVICES>().size() << " devices" << std::endl;
+			runMultiDevice(image_filename, modeBits, modeBins, platformContext, false, traceFile);
+			return 0;
+		}
+
 		// sets the openCL context
 		cl::Context context = GetContext(platform_id, device_id);
 
@@ -120,53 +3002,138 @@ int main(int argc, char **argv) {
 		std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
 
+		// runs the library headless, it builds its own kernels and queue
+		if (!outputFile.empty()) {
+			headlessEqualise(image_filename, outputFile, modeBits, modeBins, context, context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+			return 0;
+		}
+
 		// sets up command queue
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
-		cl::Program::Sources sources;
-		AddSources(sources, "kernels/my_kernels.cl");
-		cl::Program program(context, sources);
 
-		//build and debug the kernel code
-		try { 
-			program.build();
+		// starts the trace so device timestamps can be placed on the host timeline
+		trace.enabled = !traceFile.empty();
+		if (trace.enabled) {
+			trace.Start(queue);
 		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+		//build and debug the kernel code, reusing the binary from the last run when nothing has changed
+		// scans and reduce use the subgroup built-ins where the device supports them
+		string buildOptions = SubgroupOptions(device);
+		if (!buildOptions.empty()) {
+			std::cout << "Building with subgroup scans: " << buildOptions << std::endl;
+		}
+		cl::Program program = BuildProgram(context, device, "kernels/my_kernels.cl", buildOptions + " " + scanOptions);
+		registry = KernelRegistry(program, device);
+		pool = BufferPool(context, device);
+
+		// runs the video stream mode instead of the single image pipeline
+		if (streamMode) {
+			streamEqualise(image_filename, modeBits, modeBins, threshold, alpha, sampleEvery, tolerance, context, queue, program, device);
+			return 0;
 		}
 
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		// runs the benchmark instead of the single image pipeline
+		if (benchmarkMode) {
+			unsigned int benchBits = (bitsArg == 16) ? 65536 : 256;
+			unsigned int benchBins = (binsArg != 0) ? binsArg : 256;
+			runBenchmark(benchBits, benchBins, reps, context, queue, program, device);
+			return 0;
+		}
+
+		// runs the out of core tiled mode instead of the single image pipeline
+		if (tilePixels != 0) {
+			tiledEqualise(image_filename, modeBins, tilePixels, wideCounts, context, queue, program, device);
+			return 0;
+		}
+
+		// runs the packed batch mode instead of the single image pipeline
+		if (batchMode) {
+			batchEqualise(image_filename, modeBits, modeBins, queue);
+			return 0;
+		}
+
+		// equalises a region of interest instead of the whole image
+		if (roi[2] != 0) {
+			roiEqualise(image_filename, modeBits, modeBins, roi, roiWhole, queue);
+			trace.Write(traceFile);
+			return 0;
+		}
+
+		// previews a downsampled level before the full resolution pass
+		if (previewFactor != 0) {
+			previewEqualise(image_filename, modeBits, modeBins, previewFactor, refinePreview, queue);
+			trace.Write(traceFile);
+			return 0;
+		}
+
+		// runs the host and the device together instead of the single image pipeline
+		if (coExecute) {
+			coEqualise(image_filename, modeBits, modeBins, queue, device);
+			trace.Write(traceFile);
+			return 0;
+		}
+
+		// serves jobs until a client asks the server to shut down
+		if (!serveSocket.empty()) {
+			TuningDatabase serveTuning("Tuning.db");
+			serveJobs(serveSocket, autotune ? &serveTuning : NULL, context, queue, program, device);
+			trace.Write(traceFile);
+			return 0;
+		}
 
+		// runs the same image through a reusable plan instead of the single image pipeline
+		if (planRepeats != 0) {
+			unsigned int planBits = (bitsArg == 16) ? 16 : 8;
+			TuningDatabase planTuning("Tuning.db");
+			if (planBits == 16) {
+				planRepeat(CImg<unsigned short>(image_filename.c_str()), planBits, modeBins, planRepeats, autotune ? &planTuning : NULL, context, queue, program, device);
+			}
+			else {
+				planRepeat(CImg<unsigned char>(image_filename.c_str()), planBits, modeBins, planRepeats, autotune ? &planTuning : NULL, context, queue, program, device);
+			}
+			trace.Write(traceFile);
+			return 0;
+		}
 
 		//std::vector<unsigned int> tester = localsum(A , B, 8, context, queue, program);
 
+		// measures the copy bandwidth each kernel's effective bandwidth is compared against
+		double peakBandwidth = MeasurePeakBandwidth(context, queue);
+		std::cout << "Peak copy bandwidth: " << peakBandwidth << " GB/s" << std::endl;
+
 		////////////////////////////////////////////////////////
 		/////////////// Image and bin formatting
 		////////////////////////////////////////////////////////
 
 
+		auto decodeStart = std::chrono::high_resolution_clock::now();
+
 		// converts input file to a Cimg - 8bit
 		CImg<unsigned char> image_input(image_filename.c_str());
 
 		// converts input file to a Cimg - 16bit
 		CImg<unsigned short> image_input16(image_filename.c_str());
 
+		trace.AddSpan("decode", decodeStart, std::chrono::high_resolution_clock::now());
+
 		// stores the values of each pixel from the image
 		std::vector<unsigned int> pixels;
 		std::vector<unsigned int> intenEnd;
 
 		// stores the bitdepth of the image
-		unsigned int bits;
+		unsigned int bits = bitsArg;
 
 		// loops until a valid bit depth has been input
 		bool bitCheck = false;
 		while (!bitCheck) {
 
-			// takes input for bin
-			std::cout << "Is this a 8 or 16 bit image? : "; // Type a number and press enter
-			std::cin >> bits; // Get user input from the keyboard
+			// takes input for bin unless it was given on the command line
+			if (bits == 0) {
+				std::cout << "Is this a 8 or 16 bit image? : "; // Type a number and press enter
+				std::cin >> bits; // Get user input from the keyboard
+			}
 
 			// checsk if input is valid
 			if (bits == 8) {
@@ -180,7 +3147,9 @@ int main(int argc, char **argv) {
 
 
 					// converts colour space
+					auto convertStart = std::chrono::high_resolution_clock::now();
 					image_input = image_input.RGBtoYCbCr();
+					trace.AddSpan("colour conversion", convertStart, std::chrono::high_resolution_clock::now());
 					// creates vector of intensity values and vector of chroma red + blue
 					pixels.assign(image_input.begin(), image_input.begin() + (image_input.size() / 3));
 					intenEnd.assign(image_input.begin() + (image_input.size() / 3) + 1, image_input.end());
@@ -204,7 +3173,9 @@ int main(int argc, char **argv) {
 
 
 					// converts colour space
+					auto convertStart = std::chrono::high_resolution_clock::now();
 					image_input16 = image_input16.RGBtoYCbCr();
+					trace.AddSpan("colour conversion", convertStart, std::chrono::high_resolution_clock::now());
 					// creates vector of intensity values and vector of chroma red + blue
 					pixels.assign(image_input16.begin(), image_input16.begin() + (image_input16.size() / 3));
 					intenEnd.assign(image_input16.begin() + (image_input16.size() / 3) + 1, image_input16.end());
@@ -221,6 +3192,7 @@ int main(int argc, char **argv) {
 				std::cout << "Invalid input " << endl;
 				std::cin.clear();
 				std::cin.ignore(1, '\n');
+				bits = 0;
 			}
 
 		}
@@ -230,7 +3202,7 @@ int main(int argc, char **argv) {
 		bool binCheck = false;
 
 		// stores number of bins and max intesity value per pixel
-		unsigned int bins;
+		unsigned int bins = binsArg;
 
 		// stores valid to calculate which bin a pixel belongs too
 		unsigned int binsDivider;
@@ -238,15 +3210,18 @@ int main(int argc, char **argv) {
 		// loops until a valid bin is input
 		while (!binCheck) {
 
-			// takes input for bin
-			std::cout << "Please enter a number of bins that is greater than 32 and no more than " << bits << ": "; 
-			std::cin >> bins; 
+			// takes input for bin unless it was given on the command line
+			if (bins == 0) {
+				std::cout << "Please enter a number of bins that is greater than 32 and no more than " << bits << ": "; 
+				std::cin >> bins; 
+			}
 
 			// checsk if input is valid
-			if ( bits % bins != 0 && bits > 32) {
+			if (bins == 0 || (bits % bins != 0 && bits > 32)) {
 				std::cout << "Invalid input " << endl;
 				std::cin.clear();
 				std::cin.ignore(1, '\n');
+				bins = 0;
 			}
 			else {
 				binCheck = true;
@@ -276,22 +3251,45 @@ int main(int argc, char **argv) {
 		cl::Event dividerTransfer;
 		cl::Event histOut;
 
-		// creates buffer for bin calculator and the input image - buffers used in more than one Kernel
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, pixels.size() * sizeof(unsigned int));
-		cl::Buffer binDiv(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+		// takes buffers for bin calculator and the input image from the pool - buffers used in more than one Kernel
+		cl::Buffer dev_image_input = pool.Acquire(pixels.size() * sizeof(unsigned int));
+		cl::Buffer binDiv = pool.Acquire(sizeof(unsigned int));
 
 		// write previous two buffers to the memory buffer - buffers used in more than one Kernel
 		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, pixels.size() * sizeof(unsigned int), &pixels[0], NULL, &inIamgeTransfer);
 		queue.enqueueWriteBuffer(binDiv, CL_TRUE, 0, sizeof(unsigned int), &binsDivider, NULL, &dividerTransfer);
 
+		// pixel count used by the tuned kernels, which may run fewer work items than pixels
+		unsigned int pixelCount = pixels.size();
+		cl::Buffer countBuffer = pool.Acquire(sizeof(unsigned int));
+		queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(unsigned int), &pixelCount);
+
+		// the default parallel histogram and equalise stages run through the library on the program and queue already built here
+		// scan, min and normalise stay in this file, each offers methods the library does not have, chosen by prompt or by -A
+		Equaliser equaliser(context, device, queue, program);
+
+		// launch shapes tuned on earlier runs
+		TuningDatabase tuning("Tuning.db");
+
+		// costs of each stage's methods, measured the first time they are needed on this device
+		CostModel costs("CostModel.db", device.getInfo<CL_DEVICE_NAME>(), bits, bins);
+		if (autoSelect) {
+			calibrateCostModel(costs, bits, bins, context, queue, program);
+		}
+
 		// stores the images size
 		int imageSize = image_input.size();
 
 		// Asked user to choose histogram type
 		string histType;
-		std::cout << "Invalid options will run default option" << endl;
-		std::cout << "Please select which Histogram method you would like to run. P = Parallel(Default) S = Serial: ";
-		std::cin >> histType; 
+		if (autoSelect) {
+			histType = costs.Choose("histogram", { "S", "P" }, pixels.size());
+		}
+		else {
+			std::cout << "Invalid options will run default option" << endl;
+			std::cout << "Please select which Histogram method you would like to run. P = Parallel(Default) S = Serial: ";
+			std::cin >> histType;
+		}
 
 		if (histType == "S" || histType == "s") {
 
@@ -316,6 +3314,7 @@ int main(int argc, char **argv) {
 
 			// outputs execution time
 			std::cout << "Serial histogram took " << duration.count() << "NS" << endl;
+			trace.AddSpan("serial histogram", start, stop);
 		}
 		else {
 
@@ -325,37 +3324,61 @@ int main(int argc, char **argv) {
 			// create event to track runtime
 			cl::Event HistEvent;
 
-			// creates bugger for the histogram
-			cl::Buffer histogramBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+			// creates bugger for the histogram, cleared as pooled buffers keep whatever they last held
+			cl::Buffer histogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+			queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
 
-			// creates kernel and sets argumements
-			cl::Kernel histogram_Kernel(program, "histogram");
-			histogram_Kernel.setArg(0, dev_image_input);
-			histogram_Kernel.setArg(1, histogramBuffer);
-			histogram_Kernel.setArg(2, binDiv);
+			unsigned int stride = sampleStride(pixels.size(), sampleEvery, tolerance);
+			if (stride > 1) {
 
-			// calculates optimim bin size for kernel
-			int LocalSize = gcd(pixels.size(), histogram_Kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+				// counts a sample of the pixels, equalise still maps every pixel
+				sampledHistogram(dev_image_input, histogramBuffer, binDiv, pixels.size(), stride, queue, &HistEvent);
+			}
+			else if (autotune) {
+
+				// creates kernel and sets argumements
+				RegisteredKernel& histogram_Kernel = registry["histogram_coarse"];
+				histogram_Kernel.Bind(0, dev_image_input);
+				histogram_Kernel.Bind(1, histogramBuffer);
+				histogram_Kernel.Bind(2, binDiv);
+
+				// uses the tuned work group size and pixels per work item for this device and image size
+				histogram_Kernel.Bind(3, countBuffer);
+				LaunchConfig config = tuning.Tune(queue, histogram_Kernel.kernel, pixels.size(), { 1, 2, 4, 8, 16 }, [&]() {
+					queue.enqueueFillBuffer(histogramBuffer, 0u, 0, bins * sizeof(unsigned int));
+				});
+				queue.enqueueNDRangeKernel(histogram_Kernel.kernel, cl::NullRange, config.Global(pixels.size()), cl::NDRange(config.local), NULL, &HistEvent);
+			}
+			else {
 
-			// runs kernel
-			queue.enqueueNDRangeKernel(histogram_Kernel, cl::NullRange, cl::NDRange(pixels.size()), cl::NDRange(LocalSize), NULL, &HistEvent);
+				// runs the library's histogram stage
+				equaliser.histogram(dev_image_input, pixels.size(), bits, histogramBuffer, bins, &HistEvent);
+			}
 			// reads output histogram from the buffer
 			queue.enqueueReadBuffer(histogramBuffer, CL_TRUE, 0, histogramData.size() * sizeof(unsigned int), histogramData.data(), NULL, &histOut);
 
 			// outputs histogram runtime along with memeory transfer time
-			std::cout << GetFullProfilingInfo(HistEvent, ProfilingResolution::PROF_NS) << std::endl;
+			trace.AddEvent("image write", inIamgeTransfer);
+			trace.AddEvent("bin divider write", dividerTransfer);
+			trace.AddEvent("histogram", HistEvent);
+			trace.AddEvent("histogram read", histOut);
+			std::cout << GetFullProfilingInfo(HistEvent, ProfilingResolution::PROF_NS, pixels.size() * sizeof(unsigned int), bins * sizeof(unsigned int), pixels.size(), peakBandwidth) << std::endl;
 			std::cout << "Image transfer time [ns]:" << inIamgeTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inIamgeTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "binsize transfer time [ns]:" << dividerTransfer.getProfilingInfo<CL_PROFILING_COMMAND_END>() - dividerTransfer.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Output transfer time [ns]:" << histOut.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histOut.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+			pool.Release(histogramBuffer);
 			
 		}
 
 		// wrties histogram to a csv file
+		auto csvStart = std::chrono::high_resolution_clock::now();
 		ofstream histFile;
 		histFile.open("Base_Histogram.csv");
 		for (int i = 0; i < histogramData.size(); i++) {
 			histFile << i << "," << histogramData[i] << endl;
 		}
+		histFile.close();
+		trace.AddSpan("histogram csv write", csvStart, std::chrono::high_resolution_clock::now());
 
 
 		std::cout << "" << endl;
@@ -374,46 +3397,61 @@ int main(int argc, char **argv) {
 		std::vector<unsigned int> CumulativeHistogramData(bins);
 
 		// creates and writes buffer for parallel kernel histogram data
-		cl::Buffer ChistogramBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+		cl::Buffer ChistogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
 		queue.enqueueWriteBuffer(ChistogramBuffer, CL_TRUE, 0, histogramData.size() * sizeof(unsigned int), &histogramData[0], NULL, &ScanInEvent);
 
 
 
 		// asks user to choose scan type
 		string scanType;
-		std::cout << "Please select which scan method you would like to run. H = Hillis-Steele B == Blelloch(Default) S = Serial: "; // Type a number and press enter
-		std::cin >> scanType; // Get user input from the keyboard
+		bool scanLocal = bins > 256;
+		if (autoSelect) {
+
+			// the global scans run as a single work group so only fit small histograms
+			std::vector<string> scans = { "S", "H local", "B local" };
+			if (bins <= powerOfTwoBelow(min(registry["hs"].workGroupSize, registry["blelloch"].workGroupSize)) && bins == powerOfTwoBelow(bins)) {
+				scans.push_back("H global");
+				scans.push_back("B global");
+			}
+			string scanChoice = costs.Choose("scan", scans, bins);
+			scanType = scanChoice.substr(0, 1);
+			scanLocal = scanChoice.find("local") != string::npos;
+		}
+		else {
+			std::cout << "Please select which scan method you would like to run. H = Hillis-Steele B == Blelloch(Default) S = Serial: "; // Type a number and press enter
+			std::cin >> scanType; // Get user input from the keyboard
+		}
 		if (scanType == "H" || scanType == "h") {
 
 			/////////////// Runs Hillis-Steele
 			std::cout << "Hillis-Steele selected" << endl;
 			// creates and writes buffer for input and ouput histograms
-			cl::Buffer OuthistogramBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+			cl::Buffer OuthistogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
 			// sets up kernel for cumulative histogram histogram and passes arguments
 						// asks user to choose between a local and global scan
 
 			// selects type of scan based on input size
-			if (bins > 256) {
+			if (scanLocal) {
 
 				std::cout << "Local selected" << endl;
 
 				// kernel for local Hillis-steele scan
-				cl::Kernel Cumulative_kernel(program, "hs_local");
+				RegisteredKernel& Cumulative_kernel = registry["hs_local"];
 
 				// calculates optimim bin size for kernel
-				int LocalSize = gcd(pixels.size(), Cumulative_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+				int LocalSize = gcd(pixels.size(), Cumulative_kernel.workGroupSize);
 
 				// creates buffer to store local cumulative sums
 				std::vector<unsigned int>groupSums(bins / LocalSize);
-				cl::Buffer sumsBuffer(context, CL_MEM_READ_WRITE, groupSums.size() * sizeof(unsigned int));
+				cl::Buffer sumsBuffer = pool.Acquire(groupSums.size() * sizeof(unsigned int));
 				
 				// sets arguments for kernel and runs kernel
-				Cumulative_kernel.setArg(0, ChistogramBuffer);
-				Cumulative_kernel.setArg(1, OuthistogramBuffer);
-				Cumulative_kernel.setArg(2, sumsBuffer);
-				Cumulative_kernel.setArg(3, cl::Local(LocalSize * sizeof(unsigned int)));
-				Cumulative_kernel.setArg(4, cl::Local(LocalSize * sizeof(unsigned int)));
-				queue.enqueueNDRangeKernel(Cumulative_kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(LocalSize), NULL, &ScanEvent);
+				Cumulative_kernel.Bind(0, ChistogramBuffer);
+				Cumulative_kernel.Bind(1, OuthistogramBuffer);
+				Cumulative_kernel.Bind(2, sumsBuffer);
+				Cumulative_kernel.Set(3, cl::Local(LocalSize * sizeof(unsigned int)));
+				Cumulative_kernel.Set(4, cl::Local(LocalSize * sizeof(unsigned int)));
+				queue.enqueueNDRangeKernel(Cumulative_kernel.kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(LocalSize), NULL, &ScanEvent);
 
 				// reads output histogram from the buffer
 				queue.enqueueReadBuffer(OuthistogramBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), CumulativeHistogramData.data(), NULL, &ScanOutEvent);
@@ -422,7 +3460,10 @@ int main(int argc, char **argv) {
 				queue.enqueueReadBuffer(sumsBuffer, CL_TRUE, 0, groupSums.size() * sizeof(unsigned int), groupSums.data(), NULL);
 
 				// outputs histogram runtime along with memeory transfer time
-				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS) << std::endl;
+				trace.AddEvent("scan input write", ScanInEvent);
+				trace.AddEvent("hs_local", ScanEvent);
+				trace.AddEvent("scan read", ScanOutEvent);
+				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), bins * sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 				std::cout << "Input histogram transfer time [ns]:" << ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 				std::cout << "Output histogram transfer time [ns]:" << ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 
@@ -430,8 +3471,9 @@ int main(int argc, char **argv) {
 
 				// sums up local groups if the previous kernel ran with more than one workgroup
 				if (LocalSize != bins) {
-					CumulativeHistogramData = localsum(CumulativeHistogramData, groupSums, LocalSize, context, queue, program);
+					CumulativeHistogramData = localsum(CumulativeHistogramData, groupSums, LocalSize, queue);
 				}
+				pool.Release(sumsBuffer);
 
 			}
 			else {
@@ -439,19 +3481,23 @@ int main(int argc, char **argv) {
 				std::cout << "Global selected" << endl;
 
 				// runs kernel for global Hillis-steele scan
-				cl::Kernel Cumulative_Kernel(program, "hs");
-				Cumulative_Kernel.setArg(0, ChistogramBuffer);
-				Cumulative_Kernel.setArg(1, OuthistogramBuffer);
-				queue.enqueueNDRangeKernel(Cumulative_Kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(bins), NULL, &ScanEvent);
+				RegisteredKernel& Cumulative_Kernel = registry["hs"];
+				Cumulative_Kernel.Bind(0, ChistogramBuffer);
+				Cumulative_Kernel.Bind(1, OuthistogramBuffer);
+				queue.enqueueNDRangeKernel(Cumulative_Kernel.kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(bins), NULL, &ScanEvent);
 
 				// reads output histogram from the buffer
 				queue.enqueueReadBuffer(OuthistogramBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), CumulativeHistogramData.data(), NULL, &ScanOutEvent);
 
 				// outputs histogram runtime along with memeory transfer time
-				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS) << std::endl;
+				trace.AddEvent("scan input write", ScanInEvent);
+				trace.AddEvent("hs", ScanEvent);
+				trace.AddEvent("scan read", ScanOutEvent);
+				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), bins * sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 				std::cout << "Input histogram transfer time [ns]:" << ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 				std::cout << "Output histogram transfer time [ns]:" << ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			}
+			pool.Release(OuthistogramBuffer);
 
 
 
@@ -478,6 +3524,7 @@ int main(int argc, char **argv) {
 			auto stop = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
 			std::cout << "Serial scan took " << duration.count() << " NS" << endl;
+			trace.AddSpan("serial scan", start, stop);
 		}
 		else{
 
@@ -485,53 +3532,36 @@ int main(int argc, char **argv) {
 			std::cout << "Blelloch selected" << endl;
 
 			// selects type of scan based on input size
-			if (bins > 256) {
-
-				// runs kernel for local Blelloch scan
-				cl::Kernel Cumulative_kernel(program, "blelloch_local");
-
-				// calculates optimim bin size for kernel
-				int LocalSize = gcd(pixels.size(), Cumulative_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
-
-				// creates buffer to store local cumulative sums
-				std::vector<unsigned int>groupSums(bins / LocalSize);
-				cl::Buffer sumsBuffer(context, CL_MEM_READ_WRITE, groupSums.size() * sizeof(unsigned int));
+			if (scanLocal) {
 
-				// sets arguments and runs kernel
-				Cumulative_kernel.setArg(0, ChistogramBuffer);
-				Cumulative_kernel.setArg(1, sumsBuffer);
-				Cumulative_kernel.setArg(2, cl::Local(LocalSize * sizeof(unsigned int)));
-				queue.enqueueNDRangeKernel(Cumulative_kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(LocalSize), NULL, &ScanEvent);
+				// runs the work efficient local Blelloch scan, which adds the group totals on the device
+				deviceScan(ChistogramBuffer, ChistogramBuffer, bins, context, queue, program, device, &ScanEvent);
 
 				// reads histogram from kernel
 				queue.enqueueReadBuffer(ChistogramBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), CumulativeHistogramData.data(), NULL, &ScanOutEvent);
 
-				// reads groups of cumulative sums from the kernel
-				queue.enqueueReadBuffer(sumsBuffer, CL_TRUE, 0, groupSums.size() * sizeof(unsigned int), groupSums.data(), NULL);
-
 				// outputs histogram runtime along with memeory transfer time
-				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS) << std::endl;
+				trace.AddEvent("scan input write", ScanInEvent);
+				trace.AddEvent("blelloch_local", ScanEvent);
+				trace.AddEvent("scan read", ScanOutEvent);
+				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), bins * sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 				std::cout << "Input histogram transfer time [ns]:" << ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 				std::cout << "Output histogram transfer time [ns]:" << ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-
-				// sums up local groups if the previous kernel ran with more than one workgroup
-				if (LocalSize != bins) {
-					CumulativeHistogramData = localsum(CumulativeHistogramData, groupSums, LocalSize, context, queue, program);
-				}
-
-
 			}
 			else {
 
 				// runs kernel for global Blelloch scan
-				cl::Kernel Cumulative_kernel(program, "blelloch");
-				Cumulative_kernel.setArg(0, ChistogramBuffer);
-				queue.enqueueNDRangeKernel(Cumulative_kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(bins), NULL, &ScanEvent);
+				RegisteredKernel& Cumulative_kernel = registry["blelloch"];
+				Cumulative_kernel.Bind(0, ChistogramBuffer);
+				queue.enqueueNDRangeKernel(Cumulative_kernel.kernel, cl::NullRange, cl::NDRange(histogramData.size()), cl::NDRange(bins), NULL, &ScanEvent);
 				// reads output histogram from the buffer
 				queue.enqueueReadBuffer(ChistogramBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), CumulativeHistogramData.data(), NULL, &ScanOutEvent);
 
 				// outputs histogram runtime along with memeory transfer time
-				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS) << std::endl;
+				trace.AddEvent("scan input write", ScanInEvent);
+				trace.AddEvent("blelloch", ScanEvent);
+				trace.AddEvent("scan read", ScanOutEvent);
+				std::cout << GetFullProfilingInfo(ScanEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), bins * sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 				std::cout << "Input histogram transfer time [ns]:" << ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 				std::cout << "Output histogram transfer time [ns]:" << ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ScanOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 
@@ -541,12 +3571,17 @@ int main(int argc, char **argv) {
 		}
 ;
 		
+		pool.Release(ChistogramBuffer);
+
 		// outputs histogram to a csv file
+		csvStart = std::chrono::high_resolution_clock::now();
 		ofstream CumulativeHistFile;
 		CumulativeHistFile.open("Cumulative_Histogram.csv");
 		for (int i = 0; i < CumulativeHistogramData.size(); i++) {
 			CumulativeHistFile << i << "," << CumulativeHistogramData[i] << endl;
 		}
+		CumulativeHistFile.close();
+		trace.AddSpan("cumulative csv write", csvStart, std::chrono::high_resolution_clock::now());
 
 		std::cout << "" << endl;
 
@@ -562,8 +3597,13 @@ int main(int argc, char **argv) {
 
 		// asks user to choose method for finding minum number
 		string minType;
-		std::cout << "Please select which scan method you would like to find the lowest number in the dataset. S = Serial (Default) P = Parallel: ";
-		std::cin >> minType;
+		if (autoSelect) {
+			minType = costs.Choose("min", { "S", "P" }, bins);
+		}
+		else {
+			std::cout << "Please select which scan method you would like to find the lowest number in the dataset. S = Serial (Default) P = Parallel: ";
+			std::cin >> minType;
+		}
 		if (minType == "P" || minType == "p") {
 
 			// runs parallel reduce
@@ -575,31 +3615,35 @@ int main(int argc, char **argv) {
 			cl::Event MinOutEvent;
 
 			// creates and writes buffer to store output data
-			cl::Buffer numberBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
+			cl::Buffer numberBuffer = pool.Acquire(bins * sizeof(unsigned int));
 			queue.enqueueWriteBuffer(numberBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), &CumulativeHistogramData[0], NULL, &MinInEvent);
 
 			// runs kernal to find the minimun non zero number in a dataset
-			cl::Kernel Reduce(program, "reduce");
-			Reduce.setArg(0, numberBuffer);
+			RegisteredKernel& Reduce = registry["reduce"];
+			Reduce.Bind(0, numberBuffer);
 
 			// calculates optimum local workgroup size
 			cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
-			int LocalSize = gcd(bins, Reduce.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+			int LocalSize = gcd(bins, Reduce.workGroupSize);
 
-			// runs kernel
-			queue.enqueueNDRangeKernel(Reduce, cl::NullRange, cl::NDRange(CumulativeHistogramData.size()), cl::NDRange(LocalSize), NULL, &MinEvent);
+			// runs kernel as a single work group, as every group would otherwise reduce into the same first entry
+			queue.enqueueNDRangeKernel(Reduce.kernel, cl::NullRange, cl::NDRange(LocalSize), cl::NDRange(LocalSize), NULL, &MinEvent);
 
 			// reads results from buffer
 			std::vector<unsigned int> minStorage(bins);
 			queue.enqueueReadBuffer(numberBuffer, CL_TRUE, 0, minStorage.size() * sizeof(unsigned int), minStorage.data(), NULL, &MinOutEvent);
 
 			// outputs histogram runtime along with memeory transfer time
-			std::cout << GetFullProfilingInfo(MinEvent, ProfilingResolution::PROF_NS) << std::endl;
+			trace.AddEvent("min input write", MinInEvent);
+			trace.AddEvent("reduce", MinEvent);
+			trace.AddEvent("min read", MinOutEvent);
+			std::cout << GetFullProfilingInfo(MinEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 			std::cout << "Input min transfer time [ns]:" << MinInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - MinInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Output min transfer time [ns]:" << MinOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - MinOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 
 			// stores stat of array as minimum number
 			minNum = minStorage[0];
+			pool.Release(numberBuffer);
 
 		}
 		else {
@@ -627,6 +3671,7 @@ int main(int argc, char **argv) {
 			auto stop = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
 			std::cout << "Serial reduce took " << duration.count() << " NS" << endl;
+			trace.AddSpan("serial reduce", start, stop);
 		}
 
 		// reduces size of numbers to prevent overflow when normalising larger images
@@ -644,8 +3689,13 @@ int main(int argc, char **argv) {
 
 		// asks user to choose normalisation method
 		string normType;
-		std::cout << "Please select which scan method you would like to use to normalise the histogram. S = Serial P = Parallel(Default): "; // Type a number and press enter
-		std::cin >> normType; // Get user input from the keyboard
+		if (autoSelect) {
+			normType = costs.Choose("normalise", { "S", "P" }, bins);
+		}
+		else {
+			std::cout << "Please select which scan method you would like to use to normalise the histogram. S = Serial P = Parallel(Default): "; // Type a number and press enter
+			std::cin >> normType; // Get user input from the keyboard
+		}
 		if (normType == "S" || normType == "s") {
 
 			// runs serial normalisation
@@ -680,6 +3730,7 @@ int main(int argc, char **argv) {
 			auto stop = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
 			std::cout << "Serial normalise took " << duration.count() << " NS" << endl;
+			trace.AddSpan("serial normalise", start, stop);
 
 		}
 		else {
@@ -694,42 +3745,54 @@ int main(int argc, char **argv) {
 			// runs parallel normalisation
 			std::cout << "Parallel selected" << endl;
 			// creates and writes buffers for min value, max value and normalised histogram
-			cl::Buffer NhistogramBuffer(context, CL_MEM_READ_WRITE, bins * sizeof(unsigned int));
-			cl::Buffer minNumBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
-			cl::Buffer maxNumBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
-			cl::Buffer bitsBuffer(context, CL_MEM_READ_ONLY, sizeof(unsigned int));
+			cl::Buffer NhistogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+			cl::Buffer minNumBuffer = pool.Acquire(sizeof(unsigned int));
+			cl::Buffer maxNumBuffer = pool.Acquire(sizeof(unsigned int));
+			cl::Buffer bitsBuffer = pool.Acquire(sizeof(unsigned int));
 			queue.enqueueWriteBuffer(NhistogramBuffer, CL_TRUE, 0, CumulativeHistogramData.size() * sizeof(unsigned int), &CumulativeHistogramData[0], NULL, &NormInEvent);
 			queue.enqueueWriteBuffer(minNumBuffer, CL_TRUE, 0, sizeof(unsigned int), &minNum, NULL, &NormMinEvent);
 			queue.enqueueWriteBuffer(maxNumBuffer, CL_TRUE, 0, sizeof(unsigned int), &maxNum, NULL, &NormMaxEvent);
 			queue.enqueueWriteBuffer(bitsBuffer, CL_TRUE, 0, sizeof(unsigned int), &bits);
 
 			// runs normalistaion kernel
-			cl::Kernel Normalise_kernel(program, "normalise");
-			Normalise_kernel.setArg(0, NhistogramBuffer);
-			Normalise_kernel.setArg(1, minNumBuffer);
-			Normalise_kernel.setArg(2, maxNumBuffer);
-			Normalise_kernel.setArg(3, bitsBuffer);
+			RegisteredKernel& Normalise_kernel = registry["normalise"];
+			Normalise_kernel.Bind(0, NhistogramBuffer);
+			Normalise_kernel.Bind(1, minNumBuffer);
+			Normalise_kernel.Bind(2, maxNumBuffer);
+			Normalise_kernel.Bind(3, bitsBuffer);
 
 			// runs kernel
-			queue.enqueueNDRangeKernel(Normalise_kernel, cl::NullRange, cl::NDRange(CumulativeHistogramData.size()), cl::NullRange, NULL, & NormEvent);
+			queue.enqueueNDRangeKernel(Normalise_kernel.kernel, cl::NullRange, cl::NDRange(CumulativeHistogramData.size()), cl::NullRange, NULL, & NormEvent);
 			// reads results from buffer
 			queue.enqueueReadBuffer(NhistogramBuffer, CL_TRUE, 0, NormalisedHistogramData.size() * sizeof(unsigned int), NormalisedHistogramData.data(), NULL, &NormOutEvent);
 
 			// outputs histogram runtime along with memeory transfer time
-			std::cout << GetFullProfilingInfo(NormEvent, ProfilingResolution::PROF_NS) << std::endl;
+			trace.AddEvent("normalise input write", NormInEvent);
+			trace.AddEvent("min write", NormMinEvent);
+			trace.AddEvent("max write", NormMaxEvent);
+			trace.AddEvent("normalise", NormEvent);
+			trace.AddEvent("normalise read", NormOutEvent);
+			std::cout << GetFullProfilingInfo(NormEvent, ProfilingResolution::PROF_NS, bins * sizeof(unsigned int), bins * sizeof(unsigned int), bins, peakBandwidth) << std::endl;
 			std::cout << "Min transfer time [ns]:" << NormMinEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - NormMinEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Max transfer time [ns]:" << NormMaxEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - NormMaxEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Input histogram transfer time [ns]:" << NormInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - NormInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Output histogram transfer time [ns]:" << NormOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - NormOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+			pool.Release(NhistogramBuffer);
+			pool.Release(minNumBuffer);
+			pool.Release(maxNumBuffer);
+			pool.Release(bitsBuffer);
 			
 		}
 
 		// outputs normalised histogram to a .csv file
+		csvStart = std::chrono::high_resolution_clock::now();
 		ofstream NormalisedHistFile;
 		NormalisedHistFile.open("Normalised_Histogram.csv");
 		for (int i = 0; i < NormalisedHistogramData.size(); i++) {
 			NormalisedHistFile << i << "," << NormalisedHistogramData[i] << endl;
 		}
+		NormalisedHistFile.close();
+		trace.AddSpan("normalised csv write", csvStart, std::chrono::high_resolution_clock::now());
 
 		std::cout << "" << endl;
 
@@ -750,9 +3813,42 @@ int main(int argc, char **argv) {
 
 		// asks user to select which equlisation they want to use
 		string eqType;
-		std::cout << "Please select which scan method you would like to use to equalise the image. S = Serial P = Parallel(Default): "; 
-		std::cin >> eqType;
-		if (eqType == "S" || eqType == "s") {
+		if (autoSelect) {
+			// CLAHE changes the result rather than the speed, so it is only offered when asking
+			eqType = costs.Choose("equalise", { "S", "P" }, pixels.size());
+		}
+		else {
+			std::cout << "Please select which scan method you would like to use to equalise the image. S = Serial P = Parallel(Default) C = CLAHE: ";
+			std::cin >> eqType;
+		}
+		if (eqType == "C" || eqType == "c") {
+
+			// runs contrast limited adaptive equalisation, which builds its own tile histograms
+			std::cout << "CLAHE selected with " << tiles << "x" << tiles << " tiles" << endl;
+
+			// starts timer to track CLAHE
+			auto start = std::chrono::high_resolution_clock::now();
+
+			temp_output_buffer = claheEqualise(pixels, image_input.width(), image_input.height(), bits, bins, tiles, clipFactor, queue, device);
+
+			// checks if the image is colour or greyscale
+			if (image_filename.substr(image_filename.find_last_of(".") + 1) == "ppm") {
+
+				// adds the intensity pixels back to the main image
+				temp_output_buffer.insert(end(temp_output_buffer), begin(intenEnd), end(intenEnd));
+				output_buffer.assign(temp_output_buffer.begin(), temp_output_buffer.end());
+			}
+			else {
+				output_buffer = temp_output_buffer;
+			}
+
+			// Get ending timepoint
+			auto stop = std::chrono::high_resolution_clock::now();
+			auto duration = std::chrono::duration_cast<std::chrono::nanoseconds> (stop - start);
+			std::cout << "CLAHE took " << duration.count() << " NS" << endl;
+
+		}
+		else if (eqType == "S" || eqType == "s") {
 
 			// starts timer to track serial equalise 
 			auto start = std::chrono::high_resolution_clock::now();
@@ -784,6 +3880,7 @@ int main(int argc, char **argv) {
 			auto stop = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::nanoseconds> (stop - start);
 			std::cout << "Serial equalise took " << duration.count() << " NS" << endl;
+			trace.AddSpan("serial equalise", start, stop);
 
 		}
 		else {
@@ -797,23 +3894,31 @@ int main(int argc, char **argv) {
 			cl::Event EqOutEvent;
 
 			// creates and writes buffer for normalised histogram and output image
-			cl::Buffer BPhistogramBuffer(context, CL_MEM_READ_ONLY, bins * sizeof(unsigned int));
-			cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, pixels.size() * sizeof(unsigned int)); //should be the same as input image
+			cl::Buffer BPhistogramBuffer = pool.Acquire(bins * sizeof(unsigned int));
+			cl::Buffer dev_image_output = pool.Acquire(pixels.size() * sizeof(unsigned int)); //should be the same as input image
 			queue.enqueueWriteBuffer(BPhistogramBuffer, CL_TRUE, 0, NormalisedHistogramData.size() * sizeof(unsigned int), &NormalisedHistogramData[0], NULL, &EqInEvent);
 
 
 
-			// runs kernel for requalisation
-			cl::Kernel Equalise(program, "equalise");
-			Equalise.setArg(0, dev_image_input);
-			Equalise.setArg(1, dev_image_output);
-			Equalise.setArg(2, BPhistogramBuffer);
-			Equalise.setArg(3, binDiv);
+			if (autotune) {
+
+				// runs kernel for requalisation
+				RegisteredKernel& Equalise = registry["equalise_coarse"];
+				Equalise.Bind(0, dev_image_input);
+				Equalise.Bind(1, dev_image_output);
+				Equalise.Bind(2, BPhistogramBuffer);
+				Equalise.Bind(3, binDiv);
 
-			// calculates optimim bin size for kernel
-			int LocalSize = gcd(pixels.size(), Equalise.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+				// uses the tuned work group size and pixels per work item for this device and image size
+				Equalise.Bind(4, countBuffer);
+				LaunchConfig config = tuning.Tune(queue, Equalise.kernel, pixels.size(), { 1, 2, 4, 8, 16 });
+				queue.enqueueNDRangeKernel(Equalise.kernel, cl::NullRange, config.Global(pixels.size()), cl::NDRange(config.local), NULL, &EqEvent);
+			}
+			else {
 
-			queue.enqueueNDRangeKernel(Equalise, cl::NullRange, cl::NDRange(pixels.size()), cl::NDRange(LocalSize), NULL, &EqEvent);
+				// runs the library's equalise stage
+				equaliser.equalise(dev_image_input, pixels.size(), bits, BPhistogramBuffer, bins, dev_image_output, &EqEvent);
+			}
 
 
 			// checks if the image is colour or greyscale
@@ -835,13 +3940,24 @@ int main(int argc, char **argv) {
 			}
 
 			// outputs histogram runtime along with memeory transfer time
-			std::cout << GetFullProfilingInfo(EqEvent, ProfilingResolution::PROF_NS) << std::endl;
+			trace.AddEvent("look up table write", EqInEvent);
+			trace.AddEvent("equalise", EqEvent);
+			trace.AddEvent("image read", EqOutEvent);
+			std::cout << GetFullProfilingInfo(EqEvent, ProfilingResolution::PROF_NS, pixels.size() * sizeof(unsigned int) + bins * sizeof(unsigned int), pixels.size() * sizeof(unsigned int), pixels.size(), peakBandwidth) << std::endl;
 			std::cout << "Input image already stored in buffer" << endl;
 			std::cout << "bin divider already stored in buffer" << endl;
 			std::cout << "Input histogram transfer time [ns]:" << EqInEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - EqInEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
 			std::cout << "Output Image transfer time [ns]:" << EqOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - EqOutEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+			pool.Release(BPhistogramBuffer);
+			pool.Release(dev_image_output);
 
 		}
+		pool.Release(dev_image_input);
+		pool.Release(binDiv);
+		pool.Release(countBuffer);
+
+		// writes the timeline of the run
+		trace.Write(traceFile);
 
 		// checks if the image is 8 or 16 bit
 		if (bits == 65536) {
@@ -1,4 +1,49 @@
 
+// subgroup built-ins, USE_SUBGROUPS is passed in the build options when the device has one of the extensions
+#if defined(KHR_SUBGROUPS)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#elif defined(INTEL_SUBGROUPS)
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#endif
+
+#ifdef USE_SUBGROUPS
+// exclusive scan across the work group, each subgroup scans in hardware and the first subgroup scans their totals
+// every work item must call it, l needs one entry per subgroup
+uint group_scan_subgroups(uint value, local uint* l) {
+	uint lane = get_sub_group_local_id();
+	uint sg = get_sub_group_id();
+	uint count = get_num_sub_groups();
+	uint size = get_sub_group_size();
+	uint exclusive = sub_group_scan_exclusive_add(value);
+
+	// the last lane of each subgroup holds its total
+	if (lane == size - 1) {
+		l[sg] = exclusive + value;
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// scans the subgroup totals a subgroup's width at a time
+	if (sg == 0) {
+		uint carry = 0;
+		for (uint base = 0; base < count; base += size) {
+			uint i = base + lane;
+			uint total = (i < count) ? l[i] : 0;
+			uint scanned = sub_group_scan_exclusive_add(total);
+			if (i < count) {
+				l[i] = scanned + carry;
+			}
+			carry += sub_group_reduce_add(total);
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return exclusive + l[sg];
+}
+#endif
+
 // counts occurence of each intensity
 kernel void histogram(global const uint* A, global uint* H, global uint* binsDivider) {
 	
@@ -63,61 +108,94 @@ kernel void blelloch(global  uint* A) {
 	}
 }
 
-// cumulative histogram using Blelloch scan on local memory
-kernel void blelloch_local(global  uint* A, global uint* sums,local uint* l) {
+// values each work item of blelloch_local scans, set by the host's scanItems through -DSCAN_ITEMS, this default only serves other builds
+#ifndef SCAN_ITEMS
+#define SCAN_ITEMS 4
+#endif
+
+// pads local indices by one entry every 32 so the strided accesses of the scan tree fall in different banks
+#define LOG_BANKS 5
+#define PAD(i) ((i) + ((i) >> LOG_BANKS))
+
+// work efficient inclusive scan in place, each work group scans SCAN_ITEMS * local size values
+// each work item scans its own values in registers and the work group Blelloch scans the work item totals,
+// with the active work items packed at the start of the group so whole wavefronts retire at each level
+// l needs PAD(local size - 1) + 1 entries, sums gets the total of every group to be added on afterwards
+kernel void blelloch_local(global uint* A, global uint* sums, local uint* l) {
 	
 	// get index values
-	int id = get_global_id(0);
 	int lid = get_local_id(0);
 	int n = get_local_size(0);
-	int t;
 	int group = get_group_id(0);
+	int base = (group * n + lid) * SCAN_ITEMS;
+
+	// scans this work item's values in registers
+	uint v[SCAN_ITEMS];
+	uint total = 0;
+	for (int i = 0; i < SCAN_ITEMS; i++) {
+		total += A[base + i];
+		v[i] = total;
+	}
 
-	// passes global memory to local
-	l[lid] = A[id];
+#ifdef USE_SUBGROUPS
 
-	// syncs memeory
-	barrier(CLK_LOCAL_MEM_FENCE);
+	// the subgroup scan replaces the tree, the last work item's inclusive total is the group total
+	uint offset = group_scan_subgroups(total, l);
+	if (lid == n - 1) {
+		sums[group] = offset + total;
+	}
+#else
+	l[PAD(lid)] = total;
 
-	// runs upsweep on vector
-	for (int stride = 1; stride < n; stride *=2){
-		if(((lid+1) % (stride*2)) == 0){
+	// runs upsweep, at each level the first n / (stride * 2) work items do the adds
+	for (int stride = 1; stride < n; stride *= 2) {
 
-			// passes values forward
-			l[lid] += l[lid - stride];
-		}
 		// syncs memeory
 		barrier(CLK_LOCAL_MEM_FENCE);
-	}
-
-	// runs downsweep on vector
-	if (lid == 0){
-		l[n-1] = 0;
+		int i = (lid + 1) * stride * 2 - 1;
+		if (i < n) {
+			l[PAD(i)] += l[PAD(i - stride)];
+		}
 	}
 
 	// syncs memeory
 	barrier(CLK_LOCAL_MEM_FENCE);
 
+	// store cumulative sums for global addition and clears the root for the downsweep
+	if (lid == 0) {
+		sums[group] = l[PAD(n - 1)];
+		l[PAD(n - 1)] = 0;
+	}
 
-	for (int stride = n/2; stride > 0; stride /= 2){
-		if(((lid+1) % (stride*2)) == 0){
+	// runs downsweep, leaving the total of every earlier work item in each entry
+	for (int stride = n / 2; stride > 0; stride /= 2) {
 
-			// passes values forward
-			t = l[lid];
-			l[lid] += l[lid - stride];
-			l[lid - stride] = t;
-		}
 		// syncs memeory
 		barrier(CLK_LOCAL_MEM_FENCE);
+		int i = (lid + 1) * stride * 2 - 1;
+		if (i < n) {
+			uint t = l[PAD(i - stride)];
+			l[PAD(i - stride)] = l[PAD(i)];
+			l[PAD(i)] += t;
+		}
 	}
 
-	// store cumulative sums for global addition
-	if(lid == n-1){
-		sums[group] = l[lid];
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint offset = l[PAD(lid)];
+#endif
+
+	// adds the earlier work items to this work item's values, each value is only written by this work item
+	for (int i = 0; i < SCAN_ITEMS; i++) {
+		A[base + i] = v[i] + offset;
 	}
+}
 
-	// adds to local memory to global
-	atomic_xchg(&A[id], l[lid]);
+// adds the scanned totals of the earlier groups to every value
+// launched with the span of one group as the global offset so the first group is skipped
+kernel void scan_add(global uint* A, global const uint* sums, global const uint* span) {
+	int id = get_global_id(0);
+	A[id] += sums[id / *span - 1];
 }
 
 // Hillis-Steele basic inclusive scan
@@ -151,6 +229,19 @@ kernel void hs_local(global uint* A, global uint* B, global uint* sum,local uint
 	int lid = get_local_id(0);
 	int group = get_group_id(0);
 
+#ifdef USE_SUBGROUPS
+
+	// the subgroup scan replaces the log steps through local memory
+	uint value = A[id];
+	uint scanned = group_scan_subgroups(value, lA) + value;
+
+	// store cumulative sums for global addition
+	if (lid == N - 1) {
+		sum[group] = scanned;
+	}
+	B[id] = scanned;
+#else
+
 	// passes global memory to local
 	lA[lid] = A[id];
 
@@ -182,6 +273,7 @@ kernel void hs_local(global uint* A, global uint* B, global uint* sum,local uint
 
 	// adds local memory to global
 	atomic_xchg(&B[id], lB[lid]);
+#endif
 }
 
 // adds cumulative sums to local work groups
@@ -194,10 +286,37 @@ kernel void local_Sum(global uint* hist, global uint* sums){
 }
 
 // a kernel to find the smallest non 0 number in the dataset
+// it must be launched as a single work group, the first entry is reset and rewritten in place
+// so a second group would race with it, and the minimum is taken over the first work group size entries
 kernel void reduce(global uint* A){
 	int id = get_local_id(0);
 	int N = get_local_size(0);
 
+#ifdef USE_SUBGROUPS
+
+	// each subgroup finds its minimum in hardware, zeros are skipped by treating them as the largest value
+	uint value = (A[id] != 0) ? A[id] : UINT_MAX;
+	value = sub_group_reduce_min(value);
+
+	// syncs memeory so every value is read before the first entry is reset
+	barrier(CLK_GLOBAL_MEM_FENCE);
+	if (id == 0) {
+		A[0] = UINT_MAX;
+	}
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	// the first lane of each subgroup folds its minimum into the first entry
+	if (get_sub_group_local_id() == 0) {
+		atomic_min(&A[0], value);
+	}
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	// a histogram with no non zero entries reports 0
+	if (id == 0 && A[0] == UINT_MAX) {
+		A[0] = 0;
+	}
+#else
+
 	// loops through vector
 	for(int stride=1; stride<N; stride*=2){
 		if((id % (stride*2)) == 0){
@@ -212,6 +331,7 @@ kernel void reduce(global uint* A){
 		// syncs memeory
 		barrier(CLK_GLOBAL_MEM_FENCE);
 	}
+#endif
 }
 
 
@@ -251,3 +371,559 @@ kernel void equalise( global uint* in, global uint* out,global uint* hist, globa
 }
 
 
+
+
+// a kernel to measure how far a histogram has drifted from a reference histogram
+// the sum counts every pixel that moved bin twice, once where it left and once where it arrived
+kernel void hist_distance(global const uint* H, global const uint* P, global uint* D) {
+	int id = get_global_id(0);
+
+	// absolute difference of the two bins
+	uint diff = abs_diff(H[id], P[id]);
+
+	// skips empty differences to save on atomic traffic
+	if (diff != 0) {
+		atomic_add(D, diff);
+	}
+}
+
+// a kernel to find the min and max values of a cumulative histogram on the device
+kernel void cdf_bounds(global const uint* C, global uint* min, global uint* max) {
+	int id = get_global_id(0);
+	int N = get_global_size(0);
+
+	// the histogram is cumulative so the first non zero entry is the minimum
+	if (C[id] != 0 && (id == 0 || C[id - 1] == 0)) {
+		// scaled down to match the host side overflow prevention
+		*min = C[id] / 10;
+	}
+
+	// the final entry is the maximum
+	if (id == N - 1) {
+		*max = C[id] / 10;
+	}
+}
+
+// a kernel to blend a new look up table into the current one using exponential smoothing
+kernel void lut_blend(global uint* L, global const uint* N, global const float* alpha) {
+	int id = get_global_id(0);
+
+	// moves the current value towards the new value by alpha
+	L[id] = (uint)round(mix((float)L[id], (float)N[id], *alpha));
+}
+
+
+// counts a contrast limited histogram for each tile of the image, one work group per tile
+// params holds width, height, tiles across, tiles down, clip limit and number of bins
+kernel void clahe_histogram(global const uint* A, global uint* T, global const uint* binsDivider, global const uint* params, local uint* l) {
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int lw = get_local_size(0);
+	int lh = get_local_size(1);
+	int lid = ly * lw + lx;
+	int N = lw * lh;
+	int tx = get_group_id(0);
+	int ty = get_group_id(1);
+
+	uint width = params[0];
+	uint height = params[1];
+	uint tilesX = params[2];
+	uint tilesY = params[3];
+	uint clip = params[4];
+	uint bins = params[5];
+
+	// size of each tile, the last row and column of tiles may be smaller
+	uint tileW = (width + tilesX - 1) / tilesX;
+	uint tileH = (height + tilesY - 1) / tilesY;
+	uint endX = min((tx + 1) * tileW, width);
+	uint endY = min((ty + 1) * tileH, height);
+
+	// stores the total clipped from the histogram
+	local uint excess;
+
+	// clears the local histogram
+	for (uint b = lid; b < bins; b += N) {
+		l[b] = 0;
+	}
+	if (lid == 0) {
+		excess = 0;
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// counts the pixels of the tile in local memory
+	for (uint y = ty * tileH + ly; y < endY; y += lh) {
+		for (uint x = tx * tileW + lx; x < endX; x += lw) {
+			atomic_inc(&l[A[y * width + x] / (*binsDivider)]);
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// clips each bin to the limit and keeps count of what was removed
+	for (uint b = lid; b < bins; b += N) {
+		if (l[b] > clip) {
+			atomic_add(&excess, l[b] - clip);
+			l[b] = clip;
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// redistributes the clipped pixels evenly, with the remainder going to the lowest bins
+	uint share = excess / bins;
+	uint remainder = excess % bins;
+	for (uint b = lid; b < bins; b += N) {
+		T[(ty * tilesX + tx) * bins + b] = l[b] + share + (b < remainder ? 1 : 0);
+	}
+}
+
+// equalises the image by blending the look up tables of the four nearest tiles
+kernel void clahe_equalise(global const uint* in, global uint* out, global const uint* T, global const uint* binsDivider, global const uint* params) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+
+	uint width = params[0];
+	uint height = params[1];
+	int tilesX = params[2];
+	int tilesY = params[3];
+	uint bins = params[5];
+
+	uint tileW = (width + tilesX - 1) / tilesX;
+	uint tileH = (height + tilesY - 1) / tilesY;
+
+	// position of the pixel relative to the tile centres
+	float fx = (x + 0.5f) / tileW - 0.5f;
+	float fy = (y + 0.5f) / tileH - 0.5f;
+	int tx0 = clamp((int)floor(fx), 0, tilesX - 1);
+	int ty0 = clamp((int)floor(fy), 0, tilesY - 1);
+	int tx1 = min(tx0 + 1, tilesX - 1);
+	int ty1 = min(ty0 + 1, tilesY - 1);
+	float wx = clamp(fx - tx0, 0.0f, 1.0f);
+	float wy = clamp(fy - ty0, 0.0f, 1.0f);
+
+	// calculates bin location
+	uint bin = in[y * width + x] / *binsDivider;
+
+	// bilinear interpolation between the four tile look up tables
+	float top = mix((float)T[(ty0 * tilesX + tx0) * bins + bin], (float)T[(ty0 * tilesX + tx1) * bins + bin], wx);
+	float bottom = mix((float)T[(ty1 * tilesX + tx0) * bins + bin], (float)T[(ty1 * tilesX + tx1) * bins + bin], wx);
+
+	// passes intnsity to the image
+	out[y * width + x] = (uint)round(mix(top, bottom, wy));
+}
+
+
+// inclusive scan of many histograms in one launch, one work group per segment
+// segments start at offsets[segment] when offsets are given, otherwise they are packed back to back
+// each work item scans a contiguous run of bins before the runs are combined
+kernel void scan_segmented(global const uint* A, global uint* B, global const uint* offsets, global uint* totals, global uint* firsts, global const uint* bins, local uint* l) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int segment = get_group_id(0);
+	uint size = *bins;
+
+	// the histogram this group is working on
+	uint base = (offsets != 0) ? offsets[segment] : segment * size;
+
+	// the run of bins this work item looks after
+	uint run = size / N;
+	uint start = base + lid * run;
+
+	// stores the index of the first non zero bin in the segment
+	local uint first;
+	if (lid == 0) {
+		first = size;
+	}
+
+	// serial scan of this work item's run
+	uint total = 0;
+	for (uint b = start; b < start + run; b++) {
+		total += A[b];
+		B[b] = total;
+	}
+	l[lid] = total;
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Hillis-Steele scan of the run totals
+	for (int stride = 1; stride < N; stride *= 2) {
+		uint previous = (lid >= stride) ? l[lid - stride] : 0;
+
+		// syncs memeory
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		l[lid] += previous;
+
+		// syncs memeory
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// adds the total of every earlier run and finds the first non zero bin
+	uint offset = (lid == 0) ? 0 : l[lid - 1];
+	for (uint b = start; b < start + run; b++) {
+		B[b] += offset;
+	}
+	if (l[lid] != 0) {
+		for (uint b = start; b < start + run; b++) {
+			if (B[b] != 0) {
+				atomic_min(&first, b - base);
+				break;
+			}
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// stores the segment total and first non zero bin for normalisation
+	if (lid == 0) {
+		totals[segment] = l[N - 1];
+		firsts[segment] = first;
+	}
+}
+
+// normalises many cumulative histograms in one launch using the totals from scan_segmented
+// dimension 0 is the bin and dimension 1 is the segment
+// scales down by 10 and leaves bin 0 empty the same as cdf_bounds and normalise, so every mode gives the same table
+kernel void normalise_segmented(global uint* A, global const uint* offsets, global const uint* totals, global const uint* firsts, global const uint* bits) {
+	uint bin = get_global_id(0);
+	uint size = get_global_size(0);
+	uint segment = get_global_id(1);
+
+	uint base = (offsets != 0) ? offsets[segment] : segment * size;
+	uint first = firsts[segment];
+
+	// empty segments have nothing to scale
+	if (first >= size) {
+		A[base + bin] = 0;
+		return;
+	}
+
+	// reduce size of value to match the single image normalise
+	uint cdfMin = A[base + first] / 10;
+	uint cdfMax = totals[segment] / 10;
+	uint value = A[base + bin];
+
+	// scales the cumulative histogram to 0 - max size of bit depth
+	if (bin == 0 || value == 0 || cdfMax == cdfMin) {
+		A[base + bin] = 0;
+	}
+	else {
+		A[base + bin] = (double)(value / 10 - cdfMin) / (cdfMax - cdfMin) * (*bits - 1);
+	}
+}
+
+
+// finds which image of a packed batch a pixel belongs to using the start offset of each image
+uint image_of(global const uint* offsets, uint count, uint id) {
+	uint low = 0;
+	uint high = count - 1;
+
+	// binary search for the last image starting at or before the pixel
+	while (low < high) {
+		uint mid = (low + high + 1) / 2;
+		if (offsets[mid] <= id) {
+			low = mid;
+		}
+		else {
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+// counts occurence of each intensity for every image of a packed batch, one histogram per image
+kernel void histogram_batch(global const uint* A, global uint* H, global const uint* binsDivider, global const uint* offsets, global const uint* count, global const uint* bins) {
+	uint id = get_global_id(0);
+
+	// gets the image this pixel belongs to and its bin
+	uint image = image_of(offsets, *count, id);
+	uint location = A[id] / (*binsDivider);
+
+	// skips 0 values the same as the single image histogram
+	if (location != 0) {
+
+		// uses an atomic function to increment the intensity in that image's histogram
+		atomic_inc(&H[image * (*bins) + location]);
+	}
+}
+
+// equalises every image of a packed batch with its own look up table
+kernel void equalise_batch(global const uint* in, global uint* out, global const uint* hist, global const uint* binsDivider, global const uint* offsets, global const uint* count, global const uint* bins) {
+	uint id = get_global_id(0);
+
+	// gets the image this pixel belongs to and its bin
+	uint image = image_of(offsets, *count, id);
+	uint in_intensity = in[id] / (*binsDivider);
+
+	// passes intnsity to the image
+	out[id] = hist[image * (*bins) + in_intensity];
+}
+
+
+// counts a 32 bit histogram per work group in local memory, each work item strides over the pixels
+// sizes holds the number of pixels and the number of bins
+// the per group histograms are only widened to 64 bit when they are merged
+kernel void histogram_partial(global const uint* A, global uint* P, global const uint* binsDivider, global const uint* sizes, local uint* l) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int group = get_group_id(0);
+	uint count = sizes[0];
+	uint bins = sizes[1];
+
+	// clears the local histogram
+	for (uint b = lid; b < bins; b += N) {
+		l[b] = 0;
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// counts every pixel this work item is responsible for, skipping 0 values the same as the 32 bit histogram
+	for (uint id = get_global_id(0); id < count; id += get_global_size(0)) {
+		uint location = A[id] / (*binsDivider);
+		if (location != 0) {
+			atomic_inc(&l[location]);
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// writes the group's histogram to its own slice
+	for (uint b = lid; b < bins; b += N) {
+		P[group * bins + b] = l[b];
+	}
+}
+
+// as histogram_partial but counts straight into the group's slice when the bins do not fit in local memory
+kernel void histogram_partial_global(global const uint* A, global uint* P, global const uint* binsDivider, global const uint* sizes) {
+	int group = get_group_id(0);
+	uint count = sizes[0];
+	uint bins = sizes[1];
+
+	// counts every pixel this work item is responsible for, skipping 0 values the same as the 32 bit histogram
+	for (uint id = get_global_id(0); id < count; id += get_global_size(0)) {
+		uint location = A[id] / (*binsDivider);
+		if (location != 0) {
+			atomic_inc(&P[group * bins + location]);
+		}
+	}
+}
+
+// adds every group's 32 bit histogram into a 64 bit histogram, one work item per bin
+kernel void histogram_merge64(global const uint* P, global ulong* H, global const uint* groups) {
+	int id = get_global_id(0);
+	int bins = get_global_size(0);
+
+	// sums the bin across the groups
+	ulong total = 0;
+	for (uint g = 0; g < *groups; g++) {
+		total += P[g * bins + id];
+	}
+
+	// accumulates so the histogram can be built up over several launches
+	H[id] += total;
+}
+
+// inclusive 64 bit scan of a single histogram by one work group
+// each work item scans a contiguous run of bins before the runs are combined
+// bounds receives the first non zero cumulative value and the total for normalisation
+kernel void scan64(global const ulong* A, global ulong* B, global ulong* bounds, global const uint* bins, local ulong* l) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+
+	// the run of bins this work item looks after
+	uint run = *bins / N;
+	uint start = lid * run;
+
+	// stores the index of the first non zero bin
+	local uint first;
+	if (lid == 0) {
+		first = *bins;
+	}
+
+	// serial scan of this work item's run
+	ulong total = 0;
+	for (uint b = start; b < start + run; b++) {
+		total += A[b];
+		B[b] = total;
+	}
+	l[lid] = total;
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Hillis-Steele scan of the run totals
+	for (int stride = 1; stride < N; stride *= 2) {
+		ulong previous = (lid >= stride) ? l[lid - stride] : 0;
+
+		// syncs memeory
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		l[lid] += previous;
+
+		// syncs memeory
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// adds the total of every earlier run and finds the first non zero bin
+	ulong offset = (lid == 0) ? 0 : l[lid - 1];
+	for (uint b = start; b < start + run; b++) {
+		B[b] += offset;
+	}
+	if (l[lid] != 0) {
+		for (uint b = start; b < start + run; b++) {
+			if (B[b] != 0) {
+				atomic_min(&first, b);
+				break;
+			}
+		}
+	}
+
+	// syncs memeory
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+	// stores the min and max of the cumulative histogram
+	if (lid == 0) {
+		bounds[0] = (first < *bins) ? B[first] : 0;
+		bounds[1] = l[N - 1];
+	}
+}
+
+// a kernel to normalise a 64 bit cumulative histogram into a 32 bit look up table
+// scales down by 10 and leaves bin 0 empty the same as cdf_bounds and normalise, so both paths give the same table
+kernel void normalise64(global const ulong* C, global uint* L, global const ulong* bounds, global const uint* bits) {
+	int id = get_global_id(0);
+
+	// reduce size of value to match the 32 bit path
+	ulong currentValue = C[id] / 10;
+	ulong cdfMin = bounds[0] / 10;
+	ulong cdfMax = bounds[1] / 10;
+
+	if (id == 0 || C[id] == 0 || cdfMax == cdfMin) {
+		// prevents need to calculate 0 count entries
+		L[id] = 0;
+	}
+	else {
+		// scales normalistion to 0 - max size of bit depth
+		L[id] = (double)(currentValue - cdfMin) / (cdfMax - cdfMin) * (*bits - 1);
+	}
+}
+
+
+// histogram kernel where each work item counts several pixels, strided by the global size so reads stay coalesced
+kernel void histogram_coarse(global const uint* A, global uint* H, global uint* binsDivider, global const uint* count) {
+
+	for (uint id = get_global_id(0); id < *count; id += get_global_size(0)) {
+
+		// gets the intensity value from the image and calculates it's bin
+		uint location = A[id] / (*binsDivider);
+
+		// prevents issues with 0 values diplicating to size of the image
+		if (location != 0) {
+			atomic_inc(&H[location]);
+		}
+	}
+}
+
+// counts one pixel from every block of *stride pixels, adding the block's length so the counts estimate the full histogram
+// the pixel is taken at a position hashed from the block and the seed so regular patterns in the image do not line up
+// with the sampling and each run samples different pixels, the last block may be shorter and is weighted by its own length
+kernel void histogram_sampled(global const uint* A, global uint* H, global const uint* binsDivider, global const uint* count, global const uint* stride, global const uint* seed) {
+	uint id = get_global_id(0);
+	uint start = id * *stride;
+
+	if (start < *count) {
+		uint length = min(*stride, *count - start);
+		uint index = start + (((id ^ *seed) * 2654435761u) >> 16) % length;
+
+		// gets the intensity value from the image and calculates it's bin
+		uint location = A[index] / (*binsDivider);
+
+		// prevents issues with 0 values diplicating to size of the image
+		if (location != 0) {
+			atomic_add(&H[location], length);
+		}
+	}
+}
+
+// equalise kernel where each work item maps several pixels, strided by the global size so reads stay coalesced
+kernel void equalise_coarse(global const uint* in, global uint* out, global const uint* hist, global const uint* binsDivider, global const uint* count) {
+
+	for (uint id = get_global_id(0); id < *count; id += get_global_size(0)) {
+
+		// passes intnsity to the image
+		out[id] = hist[in[id] / *binsDivider];
+	}
+}
+
+
+// counts the pixels of a rectangle inside a larger image, one work item per pixel of a 2D range the size of the rectangle
+// rect holds the left column, top row and row pitch of the image in pixels
+kernel void histogram_rect(global const uint* A, global uint* H, global const uint* binsDivider, global const uint* rect) {
+	uint index = (rect[1] + get_global_id(1)) * rect[2] + rect[0] + get_global_id(0);
+
+	// gets the intensity value from the image and calculates it's bin
+	uint location = A[index] / (*binsDivider);
+
+	// prevents issues with 0 values diplicating to size of the image
+	if (location != 0) {
+		atomic_inc(&H[location]);
+	}
+}
+
+// maps the pixels of a rectangle inside a larger image through a look up table, the rest of the image is not touched
+kernel void equalise_rect(global const uint* in, global uint* out, global const uint* hist, global const uint* binsDivider, global const uint* rect) {
+	uint index = (rect[1] + get_global_id(1)) * rect[2] + rect[0] + get_global_id(0);
+
+	// passes intnsity to the image
+	out[index] = hist[in[index] / *binsDivider];
+}
+
+// averages factor x factor blocks of an image into one pixel of a smaller pyramid level, one work item per level pixel
+// dims holds the width of the full image and the factor, the level is the global size wide
+kernel void downsample(global const uint* in, global uint* out, global const uint* dims) {
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
+	uint width = dims[0];
+	uint factor = dims[1];
+
+	// sums the block the level pixel covers
+	uint sum = 0;
+	for (uint j = 0; j < factor; j++) {
+		for (uint i = 0; i < factor; i++) {
+			sum += in[(y * factor + j) * width + x * factor + i];
+		}
+	}
+	out[y * get_global_size(0) + x] = sum / (factor * factor);
+}
+
+// widens 8 bit pixels to the 32 bit values the other kernels work on
+kernel void unpack8(global const uchar* in, global uint* out) {
+	int id = get_global_id(0);
+	out[id] = in[id];
+}
+
+// widens 16 bit pixels to the 32 bit values the other kernels work on
+kernel void unpack16(global const ushort* in, global uint* out) {
+	int id = get_global_id(0);
+	out[id] = in[id];
+}
+
+// narrows equalised pixels back to 8 bit
+kernel void pack8(global const uint* in, global uchar* out) {
+	int id = get_global_id(0);
+	out[id] = in[id];
+}
+
+// narrows equalised pixels back to 16 bit
+kernel void pack16(global const uint* in, global ushort* out) {
+	int id = get_global_id(0);
+	out[id] = in[id];
+}
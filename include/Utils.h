@@ -4,6 +4,9 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <map>
+#include <functional>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -198,6 +201,21 @@ cl::Context GetContext(int platform_id, int device_id) {
 	return cl::Context();
 }
 
+// context over every device of a platform, for splitting work between them
+cl::Context GetPlatformContext(int platform_id) {
+	vector<cl::Platform> platforms;
+
+	cl::Platform::get(&platforms);
+
+	if (platform_id < platforms.size()) {
+		vector<cl::Device> devices;
+		platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		return cl::Context(devices);
+	}
+
+	return cl::Context();
+}
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,
@@ -222,4 +240,597 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 	}
 
 	return sstream.str();
-}
\ No newline at end of file
+}
+
+// extends the profiling info with the effective bandwidth and throughput of a kernel
+// bytes are the minimum the kernel has to move, so the bandwidth is compared against the device's copy bandwidth
+string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution, size_t bytesRead, size_t bytesWritten, size_t elements, double peakBandwidth = 0) {
+	stringstream sstream;
+	sstream << GetFullProfilingInfo(evnt, resolution);
+
+	double executed = (double)(evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+	if (executed > 0) {
+
+		// bytes per nanosecond is the same as GB/s
+		double bandwidth = (bytesRead + bytesWritten) / executed;
+		sstream.precision(3);
+		sstream << fixed << ", " << bandwidth << " GB/s";
+		if (peakBandwidth > 0) {
+			sstream << " (" << 100.0 * bandwidth / peakBandwidth << "% of peak)";
+		}
+		sstream << ", " << elements / executed * 1000.0 << " Mpixel/s";
+	}
+
+	return sstream.str();
+}
+
+// measures the device's peak copy bandwidth in GB/s by timing buffer to buffer copies, which read and write every byte
+double MeasurePeakBandwidth(cl::Context& context, cl::CommandQueue& queue, size_t bytes = 64 * 1024 * 1024, int repetitions = 5) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	bytes = min(bytes, (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / 2);
+
+	cl::Buffer source(context, CL_MEM_READ_ONLY, bytes);
+	cl::Buffer destination(context, CL_MEM_WRITE_ONLY, bytes);
+	queue.enqueueFillBuffer(source, (cl_uchar)0, 0, bytes);
+
+	// keeps the fastest copy, the first one also pays for the buffers being allocated
+	double best = 0;
+	for (int i = 0; i <= repetitions; i++) {
+		cl::Event copy;
+		queue.enqueueCopyBuffer(source, destination, 0, 0, bytes, NULL, &copy);
+		copy.wait();
+		double executed = (double)(copy.getProfilingInfo<CL_PROFILING_COMMAND_END>() - copy.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+		if (i > 0 && executed > 0) {
+			best = max(best, 2.0 * bytes / executed);
+		}
+	}
+
+	return best;
+}
+
+// records profiled events and host side spans so a run can be viewed as a Chrome trace (chrome://tracing or ui.perfetto.dev)
+class Trace {
+public:
+	bool enabled = false;
+
+	// lines the device clock up with the host clock by timing a marker on both
+	void Start(cl::CommandQueue& queue) {
+		cl::Event marker;
+		queue.enqueueMarkerWithWaitList(NULL, &marker);
+		marker.wait();
+		long long host = HostNow();
+		deviceOffset = host - (long long)marker.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		startTime = host;
+	}
+
+	// stores an event, its timestamps are read when the trace is written
+	void AddEvent(const string& name, const cl::Event& evnt) {
+		if (enabled && evnt() != NULL) {
+			events.push_back(make_pair(name, evnt));
+		}
+	}
+
+	// stores a host side span
+	void AddSpan(const string& name, chrono::high_resolution_clock::time_point start, chrono::high_resolution_clock::time_point end) {
+		if (enabled) {
+			spans.push_back({ name, ToNs(start), ToNs(end) });
+		}
+	}
+
+	// writes every recorded span and event in the Chrome trace event format
+	void Write(const string& filename) const {
+		if (!enabled) {
+			return;
+		}
+
+		ofstream file(filename);
+		file << "{\"traceEvents\": [" << endl;
+		file << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"Host\"}}," << endl;
+		file << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"Device queue\"}}," << endl;
+		file << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 3, \"args\": {\"name\": \"Device execution\"}}";
+
+		for (unsigned int i = 0; i < spans.size(); i++) {
+			file << "," << endl << "  " << Complete(spans[i].name, 1, spans[i].start, spans[i].end, "");
+		}
+
+		for (unsigned int i = 0; i < events.size(); i++) {
+			const cl::Event& evnt = events[i].second;
+			long long queued = (long long)evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() + deviceOffset;
+			long long submit = (long long)evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() + deviceOffset;
+			long long start = (long long)evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() + deviceOffset;
+			long long end = (long long)evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() + deviceOffset;
+
+			stringstream args;
+			args << "\"queued_ns\": " << queued - startTime << ", \"submit_ns\": " << submit - startTime << ", \"start_ns\": " << start - startTime << ", \"end_ns\": " << end - startTime;
+
+			// time spent waiting in the queue and time spent running
+			file << "," << endl << "  " << Complete(events[i].first + " (waiting)", 2, queued, start, args.str());
+			file << "," << endl << "  " << Complete(events[i].first, 3, start, end, args.str());
+		}
+
+		file << endl << "]}" << endl;
+	}
+
+private:
+	struct Span {
+		string name;
+		long long start;
+		long long end;
+	};
+
+	vector<pair<string, cl::Event>> events;
+	vector<Span> spans;
+	long long deviceOffset = 0;
+	long long startTime = 0;
+
+	static long long ToNs(chrono::high_resolution_clock::time_point time) {
+		return chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+	}
+
+	static long long HostNow() {
+		return ToNs(chrono::high_resolution_clock::now());
+	}
+
+	// a complete event, trace timestamps are in microseconds
+	string Complete(const string& name, int tid, long long start, long long end, const string& args) const {
+		stringstream sstream;
+		sstream.precision(3);
+		sstream << fixed << "{\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid;
+		sstream << ", \"ts\": " << (start - startTime) / 1000.0 << ", \"dur\": " << (end - start) / 1000.0;
+		sstream << ", \"args\": {" << args << "}}";
+		return sstream.str();
+	}
+};
+
+// largest work group size that divides a problem size, shared by the executable and the plans
+int gcd(int a, int b)
+{
+
+/***************************************************************************************
+*    Title: Program to Find GCD or HCF of Two Numbers
+*    Author: GeeksforGeeks
+*    Date: 14 Mar, 2023
+*    Code version: N/A
+*    Availability: https://www.geeksforgeeks.org/program-to-find-gcd-or-hcf-of-two-numbers/
+*
+***************************************************************************************/
+
+	int result = min(a, b); // Find Minimum of a and b
+	while (result > 0) {
+		if (a % result == 0 && b % result == 0) {
+			break;
+		}
+		result--;
+	}
+	return result; // return gcd of a and b
+}
+
+// a launch shape, local is the work group size and coarsen is the number of elements each work item handles
+struct LaunchConfig {
+	size_t local = 0;
+	size_t coarsen = 1;
+
+	// global size covering n elements, rounded up to a whole number of work groups
+	cl::NDRange Global(size_t n) const {
+		size_t items = (n + coarsen - 1) / coarsen;
+		return cl::NDRange(((items + local - 1) / local) * local);
+	}
+};
+
+// benchmarks launch shapes for each kernel, device and problem size bucket once and keeps the winners in a file
+class TuningDatabase {
+public:
+	TuningDatabase(const string& file_name) : filename(file_name) {
+		ifstream file(filename);
+		string line;
+		while (getline(file, line)) {
+			stringstream fields(line);
+			string device, kernel;
+			int bucket;
+			LaunchConfig config;
+			// skips broken entries with no work group size, they would be tuned again
+			if (getline(fields, device, '\t') && getline(fields, kernel, '\t') && fields >> bucket >> config.local >> config.coarsen && config.local != 0 && config.coarsen != 0) {
+				entries[Key(device, kernel, bucket)] = config;
+			}
+		}
+	}
+
+	// problem sizes are grouped by powers of two
+	static int Bucket(size_t n) {
+		int bucket = 0;
+		while (((size_t)2 << bucket) <= n) bucket++;
+		return bucket;
+	}
+
+	// looks up a tuned shape, benchmarking the candidates the first time it is asked for
+	// the kernel must already have its arguments set, reset is run before every trial so kernels that accumulate start clean
+	LaunchConfig Tune(cl::CommandQueue& queue, cl::Kernel& kernel, size_t n, const vector<size_t>& coarsenings, function<void()> reset = nullptr) {
+		cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+		string deviceName = device.getInfo<CL_DEVICE_NAME>();
+		string kernelName = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+		string key = Key(deviceName, kernelName, Bucket(n));
+
+		auto found = entries.find(key);
+		if (found != entries.end()) {
+			return found->second;
+		}
+
+		// candidate work group sizes double from the preferred multiple up to what the kernel allows
+		// starting no higher than the kernel allows so kernels with small work groups still get a size
+		size_t maxLocal = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+		size_t firstLocal = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+		firstLocal = max((size_t)1, min(firstLocal, maxLocal));
+		LaunchConfig best;
+		cl_ulong bestTime = 0;
+		for (size_t local = firstLocal; local <= maxLocal && local <= 1024; local *= 2) {
+			for (unsigned int c = 0; c < coarsenings.size(); c++) {
+				LaunchConfig config;
+				config.local = local;
+				config.coarsen = coarsenings[c];
+
+				// keeps the fastest of a few runs to ignore one off delays
+				cl_ulong fastest = 0;
+				for (int run = 0; run < 3; run++) {
+					if (reset) reset();
+					cl::Event evnt;
+					queue.enqueueNDRangeKernel(kernel, cl::NullRange, config.Global(n), cl::NDRange(config.local), NULL, &evnt);
+					evnt.wait();
+					cl_ulong time = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+					if (run == 0 || time < fastest) fastest = time;
+				}
+
+				if (best.local == 0 || fastest < bestTime) {
+					best = config;
+					bestTime = fastest;
+				}
+			}
+		}
+		if (reset) reset();
+
+		// a kernel that can not be launched at all is left untuned rather than stored with no work group size
+		if (best.local == 0) {
+			best.local = 1;
+			return best;
+		}
+
+		// stores the winner so later runs skip the search
+		entries[key] = best;
+		ofstream file(filename, ios::app);
+		file << deviceName << '\t' << kernelName << '\t' << Bucket(n) << " " << best.local << " " << best.coarsen << endl;
+
+		cout << "Tuned " << kernelName << " for " << n << " elements: local size " << best.local << ", " << best.coarsen << " per work item" << endl;
+		return best;
+	}
+
+private:
+	string filename;
+	map<string, LaunchConfig> entries;
+
+	static string Key(const string& device, const string& kernel, int bucket) {
+		return device + "\t" + kernel + "\t" + to_string(bucket);
+	}
+};
+
+// cost of running one stage one way, a fixed cost covering launches and round trips plus a cost per element
+struct StageCost {
+	double fixed = 0;
+	double perElement = 0;
+
+	double Predict(size_t n) const {
+		return fixed + perElement * n;
+	}
+};
+
+// measured costs of every way of running each stage on one device, kept between runs so calibration only happens once
+// each cost is the wall clock time of the whole stage including its transfers, so host and device variants compare fairly
+// costs are kept per bit depth and bin count, as both change how much work the histogram and table stages do
+class CostModel {
+public:
+	CostModel(const string& file_name, const string& device_name, unsigned int bits, unsigned int bins)
+		: filename(file_name), deviceName(device_name), setup(to_string(bits) + " " + to_string(bins)) {
+		ifstream file(filename);
+		string line;
+		while (getline(file, line)) {
+			stringstream fields(line);
+			string device, entrySetup, stage, variant;
+			StageCost cost;
+			if (getline(fields, device, '\t') && getline(fields, entrySetup, '\t') && getline(fields, stage, '\t') && getline(fields, variant, '\t') && fields >> cost.fixed >> cost.perElement
+				&& device == deviceName && entrySetup == setup) {
+				costs[Key(stage, variant)] = cost;
+			}
+		}
+	}
+
+	// fits a line through the time a variant takes at two sizes, run is only called when the variant is not in the file yet
+	StageCost Calibrate(const string& stage, const string& variant, size_t small, size_t large, function<void(size_t)> run) {
+		auto found = costs.find(Key(stage, variant));
+		if (found != costs.end()) {
+			return found->second;
+		}
+
+		double smallTime = Fastest(small, run);
+		double largeTime = Fastest(large, run);
+		StageCost cost;
+		cost.perElement = max(0.0, (largeTime - smallTime) / (large - small));
+		cost.fixed = max(0.0, smallTime - cost.perElement * small);
+
+		costs[Key(stage, variant)] = cost;
+		ofstream file(filename, ios::app);
+		file << deviceName << '\t' << setup << '\t' << stage << '\t' << variant << '\t' << cost.fixed << " " << cost.perElement << endl;
+
+		cout << "Calibrated " << stage << " " << variant << ": " << cost.fixed << " ns fixed, " << cost.perElement << " ns per element" << endl;
+		return cost;
+	}
+
+	// picks the variant predicted to be fastest for n elements, variants that were never calibrated are skipped
+	string Choose(const string& stage, const vector<string>& variants, size_t n) {
+		string best;
+		double bestTime = 0;
+		for (unsigned int i = 0; i < variants.size(); i++) {
+			auto found = costs.find(Key(stage, variants[i]));
+			if (found == costs.end()) continue;
+			double time = found->second.Predict(n);
+			if (best.empty() || time < bestTime) {
+				best = variants[i];
+				bestTime = time;
+			}
+		}
+		cout << "Cost model picked " << best << " for the " << stage << " of " << n << " elements, predicted " << (long long)bestTime << " NS" << endl;
+		return best;
+	}
+
+private:
+	string filename;
+	string deviceName;
+	string setup;
+	map<string, StageCost> costs;
+
+	static string Key(const string& stage, const string& variant) {
+		return stage + "\t" + variant;
+	}
+
+	// keeps the fastest of a few runs after a warm up to ignore one off delays
+	static double Fastest(size_t n, function<void(size_t)>& run) {
+		run(n);
+		double fastest = 0;
+		for (int i = 0; i < 3; i++) {
+			auto start = chrono::high_resolution_clock::now();
+			run(n);
+			double time = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - start).count();
+			if (i == 0 || time < fastest) fastest = time;
+		}
+		return fastest;
+	}
+};
+
+// recycles device buffers so repeated stages and images stop allocating
+// buffers up to classLimit are rounded up to a power of two size class, larger ones such as whole images are allocated
+// at exactly the size asked for and only reused for the same size, at most keepBytes of them are held while free
+// small scratch buffers are carved out of one preallocated slab as sub buffers
+// a released buffer can be handed straight out again, which is safe as every queue here is in order
+class BufferPool {
+public:
+	BufferPool() {}
+
+	BufferPool(cl::Context context, cl::Device device, size_t slabBytes = 4 * 1024 * 1024, size_t slabLimit = 256 * 1024, size_t classLimit = 1024 * 1024, size_t keepBytes = 64 * 1024 * 1024)
+		: context(context), slabSize(slabBytes), slabLimit(slabLimit), classLimit(classLimit), keepBytes(keepBytes) {
+
+		// sub buffers have to start on the device's base address alignment, given in bits
+		alignment = max((size_t)device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8, sizeof(cl_uint));
+		slab = cl::Buffer(context, CL_MEM_READ_WRITE, slabSize);
+	}
+
+	// hands out a buffer of at least the given size
+	cl::Buffer Acquire(size_t bytes) {
+		size_t size = SizeClass(bytes);
+		vector<cl::Buffer>& free = freeBuffers[size];
+		if (!free.empty()) {
+			cl::Buffer buffer = free.back();
+			free.pop_back();
+			if (size > classLimit) {
+				freeBytes -= size;
+			}
+			return buffer;
+		}
+
+		cl::Buffer buffer;
+		size_t origin = (slabUsed + alignment - 1) / alignment * alignment;
+		if (size <= slabLimit && origin + size <= slabSize) {
+			cl_buffer_region region = { origin, size };
+			buffer = slab.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+			slabUsed = origin + size;
+		}
+		else {
+			buffer = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		}
+		sizes[buffer()] = size;
+		allocations++;
+		return buffer;
+	}
+
+	// returns a buffer from Acquire to the pool
+	// large buffers past what the pool keeps are let go, so a run over many image sizes does not hold them all
+	void Release(const cl::Buffer& buffer) {
+		map<cl_mem, size_t>::iterator size = sizes.find(buffer());
+		if (size == sizes.end()) {
+			return;
+		}
+		if (size->second > classLimit) {
+			if (freeBytes + size->second > keepBytes) {
+				sizes.erase(size);
+				return;
+			}
+			freeBytes += size->second;
+		}
+		freeBuffers[size->second].push_back(buffer);
+	}
+
+	// number of buffers created so far, stops growing once every size in use has been seen
+	size_t Allocations() const {
+		return allocations;
+	}
+
+	// power of two size class for small buffers, large buffers keep their exact size
+	size_t SizeClass(size_t bytes) const {
+		if (bytes > classLimit) {
+			return bytes;
+		}
+		size_t size = 64;
+		while (size < bytes) {
+			size <<= 1;
+		}
+		return size;
+	}
+
+private:
+	cl::Context context;
+	cl::Buffer slab;
+	size_t slabSize = 0;
+	size_t slabLimit = 0;
+	size_t slabUsed = 0;
+	size_t classLimit = 0;
+	size_t keepBytes = 0;
+	size_t freeBytes = 0;
+	size_t alignment = sizeof(cl_uint);
+	size_t allocations = 0;
+	map<size_t, vector<cl::Buffer>> freeBuffers;
+	map<cl_mem, size_t> sizes;
+};
+
+// build options that switch the scan and reduce kernels to their subgroup versions when the device has a subgroup extension
+// the khr built-ins are only declared by OpenCL C 2.0 and later compilers, so the language version is raised for them
+string SubgroupOptions(cl::Device& device) {
+	string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+	if (extensions.find("cl_intel_subgroups") != string::npos) {
+		return "-DUSE_SUBGROUPS -DINTEL_SUBGROUPS";
+	}
+
+	// the version string is "OpenCL C <major>.<minor> ..."
+	string version = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+	string number = version.size() > 9 ? version.substr(9, 3) : "";
+	if (extensions.find("cl_khr_subgroups") != string::npos && !number.empty() && number[0] >= '2') {
+		return "-cl-std=CL" + number + " -DUSE_SUBGROUPS -DKHR_SUBGROUPS";
+	}
+	return "";
+}
+
+// builds a program for every given device, reusing the binaries from an earlier run when the source, options, device and driver are unchanged
+// each device's binary is kept on its own next to the source file, so builds for one device and for several share them
+cl::Program BuildProgram(cl::Context& context, vector<cl::Device>& devices, const string& file_name, const string& options = "") {
+	ifstream file(file_name);
+	if (!file.good()) {
+		throw cl::Error(CL_INVALID_VALUE, "BuildProgram: kernel file not found");
+	}
+	string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	vector<string> cacheNames;
+	for (size_t d = 0; d < devices.size(); d++) {
+		stringstream cacheName;
+		cacheName << file_name << "." << hex << std::hash<string>()(source + options + devices[d].getInfo<CL_DEVICE_NAME>() + devices[d].getInfo<CL_DRIVER_VERSION>()) << ".bin";
+		cacheNames.push_back(cacheName.str());
+	}
+
+	// tries the cached binaries first, any failure falls back to the source
+	cl::Program::Binaries binaries;
+	for (size_t d = 0; d < devices.size(); d++) {
+		ifstream cached(cacheNames[d], ios::binary);
+		if (!cached.good()) {
+			break;
+		}
+		binaries.push_back(vector<unsigned char>((istreambuf_iterator<char>(cached)), istreambuf_iterator<char>()));
+	}
+	if (binaries.size() == devices.size()) {
+		try {
+			cl::Program program(context, devices, binaries);
+			program.build(devices, options.c_str());
+			return program;
+		}
+		catch (const cl::Error&) {
+		}
+	}
+
+	cl::Program program(context, source);
+	try {
+		program.build(devices, options.c_str());
+	}
+	catch (const cl::Error& err) {
+		for (size_t d = 0; d < devices.size(); d++) {
+			cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(devices[d]) << endl;
+			cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(devices[d]) << endl;
+			cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[d]) << endl;
+		}
+		throw err;
+	}
+
+	// the binaries come back in the order of the program's devices, which covers the whole context
+	vector<cl::Device> programDevices = program.getInfo<CL_PROGRAM_DEVICES>();
+	vector<vector<unsigned char>> built = program.getInfo<CL_PROGRAM_BINARIES>();
+	for (size_t i = 0; i < built.size() && i < programDevices.size(); i++) {
+		for (size_t d = 0; d < devices.size(); d++) {
+			if (programDevices[i]() == devices[d]() && !built[i].empty()) {
+				ofstream(cacheNames[d], ios::binary).write((const char*)built[i].data(), built[i].size());
+			}
+		}
+	}
+	return program;
+}
+
+// builds a program for one device
+cl::Program BuildProgram(cl::Context& context, cl::Device& device, const string& file_name, const string& options = "") {
+	vector<cl::Device> devices = { device };
+	return BuildProgram(context, devices, file_name, options);
+}
+
+// a kernel created once with the launch limits the device reported for it
+struct RegisteredKernel {
+	cl::Kernel kernel;
+	size_t workGroupSize = 0;
+	size_t preferredMultiple = 1;
+
+	// buffers currently bound, held so a freed buffer's handle can not be reused and mistaken for a bound one
+	map<cl_uint, cl::Buffer> bound;
+
+	// sets a buffer argument only when a different buffer is bound there
+	void Bind(cl_uint index, const cl::Buffer& buffer) {
+		map<cl_uint, cl::Buffer>::iterator current = bound.find(index);
+		if (current == bound.end() || current->second() != buffer()) {
+			kernel.setArg(index, buffer);
+			bound[index] = buffer;
+		}
+	}
+
+	// sets any other argument, such as local memory, every time
+	template <typename T>
+	void Set(cl_uint index, const T& value) {
+		kernel.setArg(index, value);
+		bound.erase(index);
+	}
+};
+
+// every kernel in a program, created together so stages look them up instead of creating them per launch
+class KernelRegistry {
+public:
+	KernelRegistry() {}
+
+	KernelRegistry(cl::Program& program, cl::Device& device) {
+		vector<cl::Kernel> created;
+		program.createKernels(&created);
+		for (size_t i = 0; i < created.size(); i++) {
+			RegisteredKernel& entry = kernels[created[i].getInfo<CL_KERNEL_FUNCTION_NAME>()];
+			entry.kernel = created[i];
+			entry.workGroupSize = created[i].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+			entry.preferredMultiple = created[i].getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+		}
+	}
+
+	RegisteredKernel& operator[](const string& name) {
+		map<string, RegisteredKernel>::iterator entry = kernels.find(name);
+		if (entry == kernels.end()) {
+			throw cl::Error(CL_INVALID_KERNEL_NAME, "KernelRegistry: kernel not in program");
+		}
+		return entry->second;
+	}
+
+private:
+	map<string, RegisteredKernel> kernels;
+};